@@ -37,14 +37,32 @@ ASTERISK_REGISTER_FILE()
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <espeak/speak_lib.h>
 #include <samplerate.h>
 #include "asterisk/app.h"
+#include "asterisk/pbx.h"
+#include "asterisk/linkedlists.h"
 #include "asterisk/channel.h"
+#include "asterisk/file.h"
+#include "asterisk/frame.h"
+#include "asterisk/format.h"
+#include "asterisk/format_cache.h"
+#include "asterisk/mod_format.h"
 #include "asterisk/module.h"
 #include "asterisk/config.h"
 #include "asterisk/utils.h"
+#include "asterisk/lock.h"
+#include "asterisk/cli.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/md5.h"
+#include "asterisk/espeak.h"
 
 #define AST_MODULE "eSpeak"
 #define ESPEAK_CONFIG "espeak.conf"
@@ -58,6 +76,36 @@ ASTERISK_REGISTER_FILE()
 #define DEF_VOICE "default"
 #define DEF_DIR "/tmp"
 #define ESPK_BUFFER 2048
+#define DEF_DEGRADE_RTF 0.5
+#define DEF_DEGRADE_ACTIVE 0
+#define DEF_DEGRADE_WAIT 1000
+#define DEGRADE_HYSTERESIS 0.75
+#define RTF_WEIGHT 0.2
+#define ALIAS_BUCKETS 257
+#define FLIGHT_BUCKETS 37
+#define STREAM_MAX_SAMPLES 1024
+#define DSP_BENCH_SAMPLES 4096
+#define DSP_BENCH_LOOPS 50
+#define DSP_BENCH_RUNS 5
+#define DEF_HEDGE_PERCENTILE 95
+#define DEF_HEDGE_BUDGET 5
+#define DEF_HEDGE_COMMAND "espeak"
+#define HEDGE_HISTORY 128
+#define HEDGE_MIN_HISTORY 16
+#define HEDGE_MAX_TOKENS 5
+#define HEDGE_CHUNK 4096
+#define PRODUCER_ENGINE 1
+#define PRODUCER_HEDGE 2
+#define FILL_QUEUE_MAX 64
+#define FILL_BACKOFF 100000
+#define DEF_SILENCE_THRESHOLD 16
+#define COMPACT_MAGIC "ESR1"
+#define COMPACT_HEADER 8
+#define COMPACT_SILENCE 0x80000000U
+#define COMPACT_MIN_MS 20
+#define COMPACT_FRAME_MS 20
+#define REPLAY_MAX_PENDING 32
+#define REPLAY_CACHE DEF_DIR "/espeak-replay-XXXXXX"
 
 static const char *app = "eSpeak";
 static const char *synopsis = "Say text to the user, using eSpeak speech synthesizer.";
@@ -78,6 +126,357 @@ static int wordgap;
 static int pitch;
 static int capind;
 static const char *def_voice;
+static int degrade;
+static double degrade_rtf;
+static int degrade_active;
+static int degrade_wait;
+static const char *aliasfile;
+static const char *requestlog;
+static int requestlog_text;
+static int streaming;
+static int hedge;
+static int hedge_percentile;
+static int hedge_budget;
+static const char *hedge_command;
+static int compactsilence;
+static int silence_threshold;
+
+/* Text to recording alias, key is "voice|normalized text" */
+struct espeak_alias {
+	const char *sound;
+	char key[0];
+};
+
+static AO2_GLOBAL_OBJ_STATIC(alias_map);
+
+/* Overload degradation tiers, cheapest resampler last */
+static const struct {
+	const char *name;
+	int converter;
+} degrade_tiers[] = {
+	{ "full", SRC_SINC_FASTEST },
+	{ "reduced", SRC_LINEAR },
+	{ "minimal", SRC_ZERO_ORDER_HOLD },
+};
+
+AST_MUTEX_DEFINE_STATIC(stats_lock);
+static int active_synth;
+static int degrade_tier;
+static double rtf_avg;
+static double wait_avg;
+static unsigned int synth_count;
+static unsigned int tier_changes;
+static unsigned int alias_hits;
+static unsigned int cache_hits;
+static unsigned int stream_joins;
+static unsigned int cache_fills;
+static unsigned int hedges;
+static unsigned int hedge_wins;
+static int hedges_running;
+static double hedge_tokens;
+static int64_t first_audio[HEDGE_HISTORY];
+static unsigned int first_audio_count;
+static uint64_t compact_samples;
+
+/* The eSpeak engine is initialized once and shared by all callers */
+AST_MUTEX_DEFINE_STATIC(engine_lock);
+static int engine_rate;
+static char engine_voice[80];
+/* Callers waiting for the engine, background fills give way to them.
+ * Guarded by stats_lock. */
+static int engine_waiters;
+/* Set to stop background cache fills. Guarded by fill_lock. */
+AST_MUTEX_DEFINE_STATIC(fill_lock);
+static int fill_stop;
+
+AST_MUTEX_DEFINE_STATIC(log_lock);
+static FILE *log_file;
+static unsigned char log_key[16];
+
+/* Streamed syntheses in progress, keyed by "voice|text" */
+static struct ao2_container *flights;
+
+/* Request log replay state, one replay may run at a time. A replay runs
+ * against a scratch cache with flights and a hedge budget of its own, and
+ * stays out of the statistics and the load measures. Flights hold a
+ * reference, the scratch cache is removed with the last one. */
+struct replay {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	char *fname;
+	char *cachedir;
+	double speedup;
+	int pending;
+	unsigned int requests;
+	unsigned int aliases;
+	unsigned int predicted_hits;
+	unsigned int replayed;
+	unsigned int throttled;
+	unsigned int hits;
+	unsigned int failed;
+	unsigned int hedges;
+	double hedge_tokens;
+	int64_t *latency;
+	size_t latency_count;
+	size_t latency_alloc;
+	struct ao2_container *seen;
+	struct ao2_container *flights;
+};
+
+/* Set until the last reference to a replay is gone. Guarded by stats_lock. */
+static int replay_running;
+
+/* Build the alias lookup key: lowercased voice and text, with
+ * surrounding whitespace removed and inner whitespace collapsed. */
+static int alias_key(char *key, size_t len, const char *voice, const char *text)
+{
+	size_t pos = 0;
+	int space = 0;
+
+	for (; *voice && pos < len; voice++)
+		key[pos++] = tolower((unsigned char) *voice);
+	if (pos < len)
+		key[pos++] = '|';
+	for (; *text && pos < len; text++) {
+		if (isspace((unsigned char) *text)) {
+			space = 1;
+			continue;
+		}
+		if (space && key[pos - 1] != '|' && pos < len - 1)
+			key[pos++] = ' ';
+		space = 0;
+		key[pos++] = tolower((unsigned char) *text);
+	}
+	if (pos >= len)
+		return -1;
+	key[pos] = '\0';
+	return 0;
+}
+
+static int alias_hash_fn(const void *obj, const int flags)
+{
+	const struct espeak_alias *alias;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		alias = obj;
+		key = alias->key;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int alias_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct espeak_alias *left = obj;
+	const struct espeak_alias *right = arg;
+	const char *right_key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		right_key = right->key;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		break;
+	default:
+		return 0;
+	}
+	return strcmp(left->key, right_key) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+/* Load the alias file. Each category is a voice name and holds
+ * "soundfile = text" entries. Comments are kept to catch texts cut
+ * short by an unescaped ';'. */
+static void load_aliases(const char *alias_conf)
+{
+	struct ast_flags alias_flags = { CONFIG_FLAG_WITHCOMMENTS };
+	struct ast_config *alias_cfg;
+	struct ao2_container *aliases;
+	struct ast_variable *var;
+	struct espeak_alias *alias;
+	char *voice = NULL;
+	char key[MAXLEN];
+	size_t key_len;
+
+	if (ast_strlen_zero(alias_conf)) {
+		ao2_global_obj_release(alias_map);
+		return;
+	}
+	alias_cfg = ast_config_load(alias_conf, alias_flags);
+	if (!alias_cfg || alias_cfg == CONFIG_STATUS_FILEINVALID) {
+		ast_log(LOG_WARNING, "eSpeak: Unable to read alias file %s\n", alias_conf);
+		ao2_global_obj_release(alias_map);
+		return;
+	}
+	if (!(aliases = ao2_container_alloc(ALIAS_BUCKETS, alias_hash_fn, alias_cmp_fn))) {
+		ast_config_destroy(alias_cfg);
+		return;
+	}
+	while ((voice = ast_category_browse(alias_cfg, voice))) {
+		for (var = ast_variable_browse(alias_cfg, voice); var; var = var->next) {
+			if (ast_strlen_zero(var->name) || ast_strlen_zero(var->value)
+					|| alias_key(key, sizeof(key), voice, var->value)) {
+				ast_log(LOG_WARNING, "eSpeak: Invalid alias '%s' in voice %s\n", var->name, voice);
+				continue;
+			}
+			if (var->sameline)
+				ast_log(LOG_WARNING, "eSpeak: Text of alias '%s' in voice %s ends at a ';', "
+						"write semicolons in texts as \\;\n", var->name, voice);
+			key_len = strlen(key) + 1;
+			if (!(alias = ao2_alloc(sizeof(*alias) + key_len + strlen(var->name) + 1, NULL)))
+				continue;
+			strcpy(alias->key, key);
+			alias->sound = strcpy(alias->key + key_len, var->name);
+			ao2_link(aliases, alias);
+			ao2_ref(alias, -1);
+		}
+	}
+	ast_config_destroy(alias_cfg);
+	ast_debug(1, "eSpeak: Loaded %d aliases from %s\n", ao2_container_count(aliases), alias_conf);
+	ao2_global_obj_replace_unref(alias_map, aliases);
+	ao2_ref(aliases, -1);
+}
+
+/* Returns a reference to the alias of the text, or NULL */
+static struct espeak_alias *alias_find(const char *text, const char *voice)
+{
+	struct ao2_container *aliases;
+	struct espeak_alias *alias;
+	char key[MAXLEN];
+
+	if (!(aliases = ao2_global_obj_ref(alias_map)))
+		return NULL;
+	alias = alias_key(key, sizeof(key), voice, text) ? NULL :
+		ao2_find(aliases, key, OBJ_SEARCH_KEY);
+	ao2_ref(aliases, -1);
+	return alias;
+}
+
+/* Load the request log hashing key from fname.key, creating it with
+ * random content on first use. Texts hash alike across logs of the same
+ * install, but cannot be recovered by hashing candidate texts. */
+static int request_log_key(const char *fname)
+{
+	FILE *fl;
+	char key_name[MAXLEN];
+	size_t count = 0;
+	int fd;
+
+	snprintf(key_name, sizeof(key_name), "%s.key", fname);
+	if ((fl = fopen(key_name, "r"))) {
+		count = fread(log_key, 1, sizeof(log_key), fl);
+		fclose(fl);
+		if (count != sizeof(log_key)) {
+			ast_log(LOG_WARNING, "eSpeak: Invalid request log key %s\n", key_name);
+			return -1;
+		}
+		return 0;
+	}
+	if ((fl = fopen("/dev/urandom", "r"))) {
+		count = fread(log_key, 1, sizeof(log_key), fl);
+		fclose(fl);
+	}
+	if (count != sizeof(log_key)) {
+		ast_log(LOG_WARNING, "eSpeak: Unable to generate request log key\n");
+		return -1;
+	}
+	if ((fd = open(key_name, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1
+			|| !(fl = fdopen(fd, "w"))) {
+		ast_log(LOG_WARNING, "eSpeak: Unable to create request log key %s\n", key_name);
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	count = fwrite(log_key, 1, sizeof(log_key), fl);
+	if (fclose(fl) || count != sizeof(log_key)) {
+		ast_log(LOG_WARNING, "eSpeak: Unable to write request log key %s\n", key_name);
+		unlink(key_name);
+		return -1;
+	}
+	return 0;
+}
+
+/* (Re)open the request log, closing it if not configured */
+static void request_log_open(const char *fname)
+{
+	ast_mutex_lock(&log_lock);
+	if (log_file) {
+		fclose(log_file);
+		log_file = NULL;
+	}
+	if (!ast_strlen_zero(fname) && !request_log_key(fname)
+			&& !(log_file = fopen(fname, "a")))
+		ast_log(LOG_WARNING, "eSpeak: Unable to open request log %s\n", fname);
+	ast_mutex_unlock(&log_lock);
+}
+
+/* HMAC-MD5 of a text with the request log key, in hex */
+static void request_log_hash(char *hash, const char *text)
+{
+	struct MD5Context md5;
+	unsigned char pad[64], digest[16];
+	int i;
+
+	memset(pad, 0x36, sizeof(pad));
+	for (i = 0; i < (int) sizeof(log_key); i++)
+		pad[i] ^= log_key[i];
+	MD5Init(&md5);
+	MD5Update(&md5, pad, sizeof(pad));
+	MD5Update(&md5, (const unsigned char *) text, strlen(text));
+	MD5Final(digest, &md5);
+	memset(pad, 0x5c, sizeof(pad));
+	for (i = 0; i < (int) sizeof(log_key); i++)
+		pad[i] ^= log_key[i];
+	MD5Init(&md5);
+	MD5Update(&md5, pad, sizeof(pad));
+	MD5Update(&md5, digest, sizeof(digest));
+	MD5Final(digest, &md5);
+	for (i = 0; i < (int) sizeof(digest); i++)
+		sprintf(hash + 2 * i, "%02x", digest[i]);
+}
+
+/* Log a request that arrived at the given time as: time, keyed text hash,
+ * text length, voice, voice parameters, outcome and, if enabled, the text
+ * itself. Fields are tab separated. */
+static void request_log_at(struct timeval now, const char *text, const char *voice,
+		const char *outcome)
+{
+	char hash[33];
+	const char *c;
+
+	ast_mutex_lock(&log_lock);
+	if (!log_file) {
+		ast_mutex_unlock(&log_lock);
+		return;
+	}
+	request_log_hash(hash, text);
+	fprintf(log_file, "%ld.%03ld\t%s\t%zu\t", (long) now.tv_sec, (long) now.tv_usec / 1000,
+			hash, strlen(text));
+	/* A separator in the voice would shift the following fields */
+	for (c = voice; *c; c++)
+		fputc(*c == '\t' || *c == '\n' || *c == '\r' ? ' ' : *c, log_file);
+	fprintf(log_file, "\t%d,%d,%d,%d,%d\t%s", speed, volume, wordgap, pitch, capind, outcome);
+	if (requestlog_text) {
+		fputc('\t', log_file);
+		for (c = text; *c; c++)
+			fputc(*c == '\n' || *c == '\r' ? ' ' : *c, log_file);
+	}
+	fputc('\n', log_file);
+	fflush(log_file);
+	ast_mutex_unlock(&log_lock);
+}
+
+static void request_log(const char *text, const char *voice, const char *outcome)
+{
+	request_log_at(ast_tvnow(), text, voice, outcome);
+}
 
 static int read_config(const char *espeak_conf)
 {
@@ -92,6 +491,20 @@ static int read_config(const char *espeak_conf)
 	pitch = DEF_PITCH;
 	capind = DEF_CAPIND;
 	def_voice = DEF_VOICE;
+	degrade = 0;
+	degrade_rtf = DEF_DEGRADE_RTF;
+	degrade_active = DEF_DEGRADE_ACTIVE;
+	degrade_wait = DEF_DEGRADE_WAIT;
+	aliasfile = NULL;
+	requestlog = NULL;
+	requestlog_text = 0;
+	streaming = 0;
+	hedge = 0;
+	hedge_percentile = DEF_HEDGE_PERCENTILE;
+	hedge_budget = DEF_HEDGE_BUDGET;
+	hedge_command = DEF_HEDGE_COMMAND;
+	compactsilence = 0;
+	silence_threshold = DEF_SILENCE_THRESHOLD;
 
 	cfg = ast_config_load(espeak_conf, config_flags);
 
@@ -110,6 +523,64 @@ static int read_config(const char *espeak_conf)
 				target_sample_rate = DEF_RATE;
 			}
 		}
+		if ((temp = ast_variable_retrieve(cfg, "general", "compactsilence")))
+			compactsilence = ast_true(temp);
+		if ((temp = ast_variable_retrieve(cfg, "general", "silence_threshold"))) {
+			silence_threshold = (int) strtol(temp, NULL, 10);
+			if (errno == ERANGE || silence_threshold < 0 || silence_threshold > 32767) {
+				ast_log(LOG_WARNING, "eSpeak: Error reading silence_threshold from config file\n");
+				silence_threshold = DEF_SILENCE_THRESHOLD;
+			}
+		}
+		if ((temp = ast_variable_retrieve(cfg, "general", "aliasfile")))
+			aliasfile = temp;
+		if ((temp = ast_variable_retrieve(cfg, "general", "streaming")))
+			streaming = ast_true(temp);
+		if ((temp = ast_variable_retrieve(cfg, "general", "hedge")))
+			hedge = ast_true(temp);
+		if ((temp = ast_variable_retrieve(cfg, "general", "hedge_percentile"))) {
+			hedge_percentile = (int) strtol(temp, NULL, 10);
+			if (errno == ERANGE || hedge_percentile < 1 || hedge_percentile > 100) {
+				ast_log(LOG_WARNING, "eSpeak: Error reading hedge_percentile from config file\n");
+				hedge_percentile = DEF_HEDGE_PERCENTILE;
+			}
+		}
+		if ((temp = ast_variable_retrieve(cfg, "general", "hedge_budget"))) {
+			hedge_budget = (int) strtol(temp, NULL, 10);
+			if (errno == ERANGE || hedge_budget < 0 || hedge_budget > 100) {
+				ast_log(LOG_WARNING, "eSpeak: Error reading hedge_budget from config file\n");
+				hedge_budget = DEF_HEDGE_BUDGET;
+			}
+		}
+		if ((temp = ast_variable_retrieve(cfg, "general", "hedge_command")))
+			hedge_command = temp;
+		if ((temp = ast_variable_retrieve(cfg, "general", "requestlog")))
+			requestlog = temp;
+		if ((temp = ast_variable_retrieve(cfg, "general", "requestlog_text")))
+			requestlog_text = ast_true(temp);
+		if ((temp = ast_variable_retrieve(cfg, "general", "degrade")))
+			degrade = ast_true(temp);
+		if ((temp = ast_variable_retrieve(cfg, "general", "degrade_rtf"))) {
+			degrade_rtf = strtod(temp, NULL);
+			if (errno == ERANGE || degrade_rtf < 0) {
+				ast_log(LOG_WARNING, "eSpeak: Error reading degrade_rtf from config file\n");
+				degrade_rtf = DEF_DEGRADE_RTF;
+			}
+		}
+		if ((temp = ast_variable_retrieve(cfg, "general", "degrade_active"))) {
+			degrade_active = (int) strtol(temp, NULL, 10);
+			if (errno == ERANGE || degrade_active < 0) {
+				ast_log(LOG_WARNING, "eSpeak: Error reading degrade_active from config file\n");
+				degrade_active = DEF_DEGRADE_ACTIVE;
+			}
+		}
+		if ((temp = ast_variable_retrieve(cfg, "general", "degrade_wait"))) {
+			degrade_wait = (int) strtol(temp, NULL, 10);
+			if (errno == ERANGE || degrade_wait < 0) {
+				ast_log(LOG_WARNING, "eSpeak: Error reading degrade_wait from config file\n");
+				degrade_wait = DEF_DEGRADE_WAIT;
+			}
+		}
 		if ((temp = ast_variable_retrieve(cfg, "voice", "speed"))) {
 			speed = (int) strtol(temp, NULL, 10);
 			if (errno == ERANGE) {
@@ -155,284 +626,2391 @@ static int read_config(const char *espeak_conf)
 				target_sample_rate, DEF_RATE);
 		target_sample_rate = DEF_RATE;
 	}
+	load_aliases(aliasfile);
+	request_log_open(requestlog);
 	return 0;
 }
 
-/* espeak synthesis callback function */
-static int synth_callback(short *wav, int numsamples, espeak_EVENT *events)
+/* Load relative to the degradation thresholds, 1.0 means at threshold.
+ * Must be called with stats_lock held. */
+static double degrade_pressure(void)
 {
-	if (wav) {
-		if (fwrite(wav, sizeof(short), numsamples, events[0].user_data))
-			return 0; /* Continue synthesis */
-	}
-	return 1; /* Stop synthesis */
+	double pressure = 0;
+
+	if (degrade_rtf > 0)
+		pressure = rtf_avg / degrade_rtf;
+	if (degrade_active > 0 && (double) active_synth / degrade_active > pressure)
+		pressure = (double) active_synth / degrade_active;
+	if (degrade_wait > 0 && wait_avg / degrade_wait > pressure)
+		pressure = wait_avg / degrade_wait;
+	return pressure;
 }
 
-/* Sound data resampling */
-static int raw_resample(char *fname, double ratio)
+/* Move between tiers: tier n is entered at pressure n and left below
+ * DEGRADE_HYSTERESIS * n. Must be called with stats_lock held. */
+static void degrade_update(void)
 {
-	int res = 0;
-	FILE *fl;
-	struct stat st;
-	int in_size;
-	short *in_buff, *out_buff;
-	long in_frames, out_frames;
-	float *inp, *outp;
-	SRC_DATA rate_change;
+	int tier = degrade_tier;
+	int max_tier = ARRAY_LEN(degrade_tiers) - 1;
+	double pressure = 0;
 
-	if ((fl = fopen(fname, "r")) == NULL) {
-		ast_log(LOG_ERROR, "eSpeak: Failed to open file for resampling.\n");
-		return -1;
-	}
-	if ((stat(fname, &st) == -1)) {
-		ast_log(LOG_ERROR, "eSpeak: Failed to stat file for resampling.\n");
-		fclose(fl);
-		return -1;
+	if (degrade)
+		pressure = degrade_pressure();
+	while (tier < max_tier && pressure >= tier + 1)
+		tier++;
+	while (tier > 0 && pressure < DEGRADE_HYSTERESIS * tier)
+		tier--;
+	if (tier != degrade_tier) {
+		ast_log(LOG_NOTICE, "eSpeak: Switching from %s to %s quality (rtf %.2f, active %d, wait %.0f ms)\n",
+				degrade_tiers[degrade_tier].name, degrade_tiers[tier].name, rtf_avg, active_synth,
+				wait_avg);
+		degrade_tier = tier;
+		tier_changes++;
 	}
-	in_size = st.st_size;
-	if ((in_buff = ast_malloc(in_size)) == NULL) {
-		fclose(fl);
-		return -1;
-	}
-	if ((fread(in_buff, 1, in_size, fl) != (size_t)in_size)) {
-		ast_log(LOG_ERROR, "eSpeak: Failed to read file for resampling.\n");
-		fclose(fl);
-		res = -1;
-		goto CLEAN1;
-	}
-	fclose(fl);
-	in_frames = in_size / 2;
+}
 
-	if ((inp = (float *)(ast_malloc(in_frames * sizeof(float)))) == NULL) {
-		res = -1;
-		goto CLEAN1;
-	}
-	src_short_to_float_array(in_buff, inp, in_size/sizeof(short));
-	out_frames = (long)((double)in_frames * ratio);
-	if ((outp = (float *)(ast_malloc(out_frames * sizeof(float)))) == NULL) {
-		res = -1;
-		goto CLEAN2;
-	}
-	rate_change.data_in = inp;
-	rate_change.data_out = outp;
-	rate_change.input_frames = in_frames;
-	rate_change.output_frames = out_frames;
-	rate_change.src_ratio = ratio;
-
-	if ((res = src_simple(&rate_change, SRC_SINC_FASTEST, 1)) != 0) {
-		ast_log(LOG_ERROR, "eSpeak: Failed to resample sound file '%s': '%s'\n",
-				fname, src_strerror(res));
-		res = -1;
-		goto CLEAN3;
+/* Register a synthesis run and return the degradation tier to render it
+ * at. Replays render at the current tier without adding to the load. */
+static int synth_begin(const struct replay *replay)
+{
+	int tier;
+
+	ast_mutex_lock(&stats_lock);
+	if (!replay) {
+		active_synth++;
+		degrade_update();
 	}
+	tier = degrade_tier;
+	ast_mutex_unlock(&stats_lock);
+	return tier;
+}
 
-	if ((out_buff = ast_malloc(out_frames*sizeof(float))) == NULL) {
-		res = -1;
-		goto CLEAN3;
+/* Take engine_lock, accounting the time callers wait for it. Background
+ * fills are not counted as waiting, replays wait without being averaged. */
+static void engine_acquire(int background, const struct replay *replay)
+{
+	struct timeval queued = ast_tvnow();
+
+	if (!background) {
+		ast_mutex_lock(&stats_lock);
+		engine_waiters++;
+		ast_mutex_unlock(&stats_lock);
 	}
-	src_float_to_short_array(rate_change.data_out, out_buff, out_frames);
-	if ((fl = fopen(fname, "w+")) != NULL) {
-		if ((fwrite(out_buff, 1, 2*out_frames, fl)) != (size_t)(2*out_frames)) {
-			ast_log(LOG_ERROR, "eSpeak: Failed to write resampled output file.\n");
-			res = -1;
+	ast_mutex_lock(&engine_lock);
+	if (!background) {
+		ast_mutex_lock(&stats_lock);
+		engine_waiters--;
+		if (!replay) {
+			wait_avg += RTF_WEIGHT * (ast_tvdiff_ms(ast_tvnow(), queued) - wait_avg);
+			degrade_update();
 		}
-		fclose(fl);
-	} else {
-		ast_log(LOG_ERROR, "eSpeak: Failed to open output file for resampling.\n");
-		res = -1;
+		ast_mutex_unlock(&stats_lock);
 	}
-	ast_free(out_buff);
-CLEAN3:
-	ast_free(outp);
-CLEAN2:
-	ast_free(inp);
-CLEAN1:
-	ast_free(in_buff);
-	return res;
 }
 
-static int espeak_exec(struct ast_channel *chan, const char *data)
+/* Whether background cache fills were asked to stop */
+static int fill_stopping(void)
 {
-	int res = 0;
-	FILE *fl;
-	int raw_fd;
-	espeak_ERROR espk_error;
-	char *mydata, *format;
-	int writecache = 0;
-	char cachefile[MAXLEN];
-	char raw_name[17] = "/tmp/espk_XXXXXX";
-	char slin_name[23];
-	int sample_rate;
-	const char *voice;
-	AST_DECLARE_APP_ARGS(args,
-		AST_APP_ARG(text);
-		AST_APP_ARG(interrupt);
-		AST_APP_ARG(language);
-	);
+	int stop;
 
-	if (ast_strlen_zero(data)) {
-		ast_log(LOG_ERROR, "eSpeak requires arguments (text and options)\n");
-		return -1;
-	}
-	mydata = ast_strdupa(data);
-	AST_STANDARD_APP_ARGS(args, mydata);
+	ast_mutex_lock(&fill_lock);
+	stop = fill_stop;
+	ast_mutex_unlock(&fill_lock);
+	return stop;
+}
 
-	if (args.interrupt && !strcasecmp(args.interrupt, "any"))
-		args.interrupt = AST_DIGIT_ANY;
+/* Whether a background fill holding the engine should give it up */
+static int engine_wanted(void)
+{
+	int wanted;
 
-	if (!ast_strlen_zero(args.language)) {
-		voice = args.language;
-	} else {
-		voice = def_voice;
-	}
+	ast_mutex_lock(&stats_lock);
+	wanted = engine_waiters > 0;
+	ast_mutex_unlock(&stats_lock);
+	return wanted || fill_stopping();
+}
 
-	args.text = ast_strip_quoted(args.text, "\"", "\"");
-	if (ast_strlen_zero(args.text)) {
-		ast_log(LOG_WARNING, "eSpeak: No text passed for synthesis.\n");
-		return res;
+/* Account a finished synthesis run, audio_ms is 0 on failure */
+static void synth_end(const struct replay *replay, int64_t elapsed_ms, int64_t audio_ms)
+{
+	if (replay)
+		return;
+	ast_mutex_lock(&stats_lock);
+	active_synth--;
+	if (audio_ms > 0) {
+		double rtf = (double) elapsed_ms / audio_ms;
+		rtf_avg = synth_count ? rtf_avg + RTF_WEIGHT * (rtf - rtf_avg) : rtf;
+		synth_count++;
 	}
+	degrade_update();
+	ast_mutex_unlock(&stats_lock);
+}
 
-	ast_debug(1,
-			  "eSpeak:\nText passed: %s\nInterrupt key(s): %s\nLanguage: %s\nRate: %lf\n",
-			  args.text, args.interrupt, voice, target_sample_rate);
+static void pcm_destructor(void *obj)
+{
+	struct ast_espeak_pcm *pcm = obj;
 
-	/*Cache mechanism */
-	if (usecache) {
-		char MD5_name[33];
-		ast_md5_hash(MD5_name, args.text);
-		if (strlen(cachedir) + strlen(MD5_name) + 6 <= MAXLEN) {
-			ast_debug(1, "eSpeak: Activating cache mechanism...\n");
-			snprintf(cachefile, sizeof(cachefile), "%s/%s", cachedir, MD5_name);
-			if (ast_fileexists(cachefile, NULL, NULL) <= 0) {
-				ast_debug(1, "eSpeak: Cache file does not yet exist.\n");
-				writecache = 1;
-			} else {
-				ast_debug(1, "eSpeak: Cache file exists.\n");
-				if (ast_channel_state(chan) != AST_STATE_UP)
-					ast_answer(chan);
-				res = ast_streamfile(chan, cachefile, ast_channel_language(chan));
-				if (res) {
-					ast_log(LOG_ERROR, "eSpeak: ast_streamfile from cache failed on %s\n",
-							ast_channel_name(chan));
-				} else {
-					res = ast_waitstream(chan, args.interrupt);
-					ast_stopstream(chan);
-					return res;
-				}
-			}
-		}
-	}
+	ast_free(pcm->data);
+}
 
-	/* Invoke eSpeak */
-	if ((sample_rate = espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS, ESPK_BUFFER, NULL, 0)) == -1) {
-		ast_log(LOG_ERROR, "eSpeak: Internal espeak error, aborting.\n");
-		return -1;
-	}
-	espeak_SetSynthCallback(synth_callback);
-	if ( espeak_SetVoiceByName(voice) != EE_OK ) {
-		ast_log(LOG_ERROR, "eSpeak: Failed to set voice=%s.\n", voice);
-		return -1;
-	}
-	if ( espeak_SetParameter(espeakRATE, speed, 0) != EE_OK ) {
-		ast_log(LOG_ERROR, "eSpeak: Failed to set speed=%d.\n", speed);
-		return -1;
-	}
-	if ( espeak_SetParameter(espeakVOLUME, volume, 0) != EE_OK ) {
-		ast_log(LOG_ERROR, "eSpeak: Failed to set volume=%d.\n", volume);
-		return -1;
-	}
-	if ( espeak_SetParameter(espeakWORDGAP, wordgap, 0) != EE_OK ) {
-		ast_log(LOG_ERROR, "eSpeak: Failed to set wordgap=%d.\n", wordgap);
-		return -1;
-	}
-	if ( espeak_SetParameter(espeakPITCH, pitch, 0) != EE_OK ) {
-		ast_log(LOG_ERROR, "eSpeak: Failed to set pitch=%d.\n", pitch);
-		return -1;
-	}
-	if ( espeak_SetParameter(espeakCAPITALS, capind, 0) != EE_OK ) {
-		ast_log(LOG_ERROR, "eSpeak: Failed to set capind=%d.\n", capind);
-		return -1;
-	}
+static struct ast_espeak_pcm *pcm_alloc(unsigned int rate)
+{
+	struct ast_espeak_pcm *pcm;
 
-	if ((raw_fd = mkstemp(raw_name)) == -1) {
-		ast_log(LOG_ERROR, "eSpeak: Failed to create audio file.\n");
-		return -1;
-	}
-	if ((fl = fdopen(raw_fd, "w+")) == NULL) {
-		ast_log(LOG_ERROR, "eSpeak: Failed to open audio file '%s'\n", raw_name);
-		return -1;
-	}
+	if (!(pcm = ao2_alloc(sizeof(*pcm), pcm_destructor)))
+		return NULL;
+	pcm->rate = rate;
+	return pcm;
+}
 
-	espk_error = espeak_Synth(args.text, strlen(args.text), 0, POS_CHARACTER,
-			(int) strlen(args.text), espeakCHARS_AUTO, NULL, fl);
-	espeak_Terminate();
-	fclose(fl);
-	if (espk_error != EE_OK) {
-		ast_log(LOG_ERROR,
-				"eSpeak: Failed to synthesize speech for the specified text.\n");
-		unlink(raw_name);
-		return -1;
-	}
+/* Append samples to the audio buffer, growing it as needed */
+static int pcm_append(struct ast_espeak_pcm *pcm, const short *samples, size_t count)
+{
+	short *data;
+	size_t size;
 
-	/* Resample sound file */
-	if (sample_rate != target_sample_rate) {
-		double ratio = (double) target_sample_rate / (double) sample_rate;
-		if ((res = raw_resample(raw_name, ratio)) != 0) {
+	if (pcm->samples + count > pcm->allocated) {
+		size = MAX(pcm->allocated * 2, pcm->samples + count);
+		if (!(data = ast_realloc(pcm->data, size * sizeof(short))))
 			return -1;
-		}
-	}
-
-	/* Create filenames */
-	if (target_sample_rate == 16000) {
-		format = "sln16";
-	} else {
-		format = "sln";
-	}
-	snprintf(slin_name, sizeof(slin_name), "%s.%s", raw_name, format);
-	rename(raw_name, slin_name);
-
-	if (ast_channel_state(chan) != AST_STATE_UP)
-		ast_answer(chan);
-	res = ast_streamfile(chan, raw_name, ast_channel_language(chan));
-	if (res) {
-		ast_log(LOG_ERROR, "eSpeak: ast_streamfile failed on %s\n", ast_channel_name(chan));
-	} else {
-		res = ast_waitstream(chan, args.interrupt);
-		ast_stopstream(chan);
+		pcm->data = data;
+		pcm->allocated = size;
 	}
+	memcpy(pcm->data + pcm->samples, samples, count * sizeof(short));
+	pcm->samples += count;
+	return 0;
+}
 
-	/* Save file to cache if set */
-	if (writecache) {
-		ast_debug(1, "eSpeak: Saving cache file %s\n", cachefile);
-		ast_filerename(raw_name, cachefile, format);
-	} else {
-		unlink(slin_name);
-	}
-	return res;
+static const char *pcm_format(const struct ast_espeak_pcm *pcm)
+{
+	return pcm->rate == 16000 ? "sln16" : "sln";
 }
 
-static int reload_module(void)
+static int pcm_fwrite(const struct ast_espeak_pcm *pcm, FILE *fl)
 {
-	ast_config_destroy(cfg);
-	read_config(ESPEAK_CONFIG);
+	if (fwrite(pcm->data, sizeof(short), pcm->samples, fl) != pcm->samples)
+		return -1;
 	return 0;
 }
 
-static int unload_module(void)
+/* Silence-compacted audio files (.esr at 8000Hz, .esr16 at 16000Hz) start
+ * with COMPACT_MAGIC and the sample rate, followed by records of a 32 bit
+ * header. A header with COMPACT_SILENCE set stands for that many samples
+ * of silence, any other is followed by that many samples of audio. Runs
+ * of samples no louder than silence_threshold and at least COMPACT_MIN_MS
+ * long are stored as silence. Everything is in native byte order, like
+ * the sln files. The module registers these as Asterisk file formats, so
+ * cache entries play through ast_streamfile() like any sound file. */
+static const char *compact_format(unsigned int rate)
 {
-	ast_config_destroy(cfg);
-	return ast_unregister_application(app);
+	return rate == 16000 ? "esr16" : "esr";
 }
 
-static int load_module(void)
+static int compact_record(FILE *fl, const short *data, uint32_t count, int silence)
 {
-	read_config(ESPEAK_CONFIG);
-	return ast_register_application(app, espeak_exec, synopsis, descrip) ?
-		AST_MODULE_LOAD_DECLINE : AST_MODULE_LOAD_SUCCESS;
+	uint32_t header = silence ? count | COMPACT_SILENCE : count;
+
+	if (!count)
+		return 0;
+	if (fwrite(&header, sizeof(header), 1, fl) != 1)
+		return -1;
+	if (!silence && fwrite(data, sizeof(short), count, fl) != count)
+		return -1;
+	return 0;
+}
+
+static int compact_write_header(FILE *fl, unsigned int rate)
+{
+	uint32_t header_rate = rate;
+
+	if (fwrite(COMPACT_MAGIC, 4, 1, fl) != 1 || fwrite(&header_rate, sizeof(header_rate), 1, fl) != 1)
+		return -1;
+	return 0;
+}
+
+static int compact_fwrite(const struct ast_espeak_pcm *pcm, FILE *fl)
+{
+	size_t min_run = pcm->rate * COMPACT_MIN_MS / 1000;
+	size_t i = 0, run, literal = 0, silence = 0;
+	const short *data = pcm->data;
+
+	if (pcm->samples >= COMPACT_SILENCE)
+		return -1;
+	if (compact_write_header(fl, pcm->rate))
+		return -1;
+	while (i < pcm->samples) {
+		if (abs(data[i]) > silence_threshold) {
+			i++;
+			continue;
+		}
+		for (run = i; i < pcm->samples && abs(data[i]) <= silence_threshold; i++)
+			;
+		if (i - run < min_run)
+			continue;
+		if (compact_record(fl, data + literal, run - literal, 0)
+				|| compact_record(fl, NULL, i - run, 1))
+			return -1;
+		silence += i - run;
+		literal = i;
+	}
+	if (compact_record(fl, data + literal, pcm->samples - literal, 0))
+		return -1;
+	ast_mutex_lock(&stats_lock);
+	compact_samples += silence;
+	ast_mutex_unlock(&stats_lock);
+	return 0;
+}
+
+/* Sequential decoder of a silence-compacted file */
+struct compact_reader {
+	FILE *fl;
+	/* Samples left in the current record */
+	uint32_t audio;
+	uint32_t silence;
+	/* Samples decoded so far */
+	off_t pos;
+};
+
+/* Check the file header against the expected sample rate */
+static int compact_read_header(FILE *fl, unsigned int rate)
+{
+	char magic[4];
+	uint32_t header_rate;
+
+	if (fread(magic, sizeof(magic), 1, fl) != 1 || memcmp(magic, COMPACT_MAGIC, 4)
+			|| fread(&header_rate, sizeof(header_rate), 1, fl) != 1 || header_rate != rate)
+		return -1;
+	return 0;
+}
+
+/* Fetch the next record header. Returns 0 at the end of the file. */
+static int compact_next(struct compact_reader *reader)
+{
+	uint32_t header;
+
+	if (fread(&header, sizeof(header), 1, reader->fl) != 1)
+		return 0;
+	if (header & COMPACT_SILENCE)
+		reader->silence = header & ~COMPACT_SILENCE;
+	else
+		reader->audio = header;
+	return 1;
+}
+
+/* Decode up to count samples. Returns the number of samples decoded,
+ * 0 at the end of the file or -1 on a truncated file. */
+static int compact_decode(struct compact_reader *reader, short *out, int count)
+{
+	int n, done = 0;
+
+	while (done < count) {
+		if (reader->silence) {
+			n = MIN(reader->silence, (uint32_t) (count - done));
+			memset(out + done, 0, n * sizeof(short));
+			reader->silence -= n;
+		} else if (reader->audio) {
+			n = MIN(reader->audio, (uint32_t) (count - done));
+			if (fread(out + done, sizeof(short), n, reader->fl) != (size_t) n)
+				return -1;
+			reader->audio -= n;
+		} else if (compact_next(reader)) {
+			continue;
+		} else {
+			break;
+		}
+		done += n;
+	}
+	reader->pos += done;
+	return done;
+}
+
+/* Move forward by up to count samples without decoding them, or to the
+ * end with a negative count */
+static int compact_skip(struct compact_reader *reader, off_t count)
+{
+	uint32_t n;
+
+	while (count) {
+		if (reader->silence) {
+			n = count < 0 ? reader->silence : MIN(reader->silence, (uint64_t) count);
+			reader->silence -= n;
+		} else if (reader->audio) {
+			n = count < 0 ? reader->audio : MIN(reader->audio, (uint64_t) count);
+			if (fseeko(reader->fl, (off_t) n * sizeof(short), SEEK_CUR))
+				return -1;
+			reader->audio -= n;
+		} else if (compact_next(reader)) {
+			continue;
+		} else {
+			break;
+		}
+		reader->pos += n;
+		if (count > 0)
+			count -= n;
+	}
+	return 0;
+}
+
+static int esr_open(struct ast_filestream *s)
+{
+	struct compact_reader *reader = s->_private;
+
+	reader->fl = s->f;
+	if (compact_read_header(s->f, ast_format_get_sample_rate(s->fmt->format))) {
+		ast_log(LOG_WARNING, "eSpeak: Invalid %s file\n", s->fmt->name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Header of a file opened for writing */
+static int esr_rewrite(struct ast_filestream *s, const char *comment)
+{
+	struct compact_reader *reader = s->_private;
+
+	(void) comment;
+	reader->fl = s->f;
+	return compact_write_header(s->f, ast_format_get_sample_rate(s->fmt->format));
+}
+
+static struct ast_frame *esr_read(struct ast_filestream *s, int *whennext)
+{
+	struct compact_reader *reader = s->_private;
+	int samples = ast_format_get_sample_rate(s->fmt->format) * COMPACT_FRAME_MS / 1000;
+	int count;
+
+	AST_FRAME_SET_BUFFER(&s->fr, s->buf, AST_FRIENDLY_OFFSET, samples * sizeof(short));
+	if ((count = compact_decode(reader, s->fr.data.ptr, samples)) <= 0) {
+		if (count)
+			ast_log(LOG_WARNING, "eSpeak: Truncated %s file\n", s->fmt->name);
+		return NULL;
+	}
+	*whennext = s->fr.samples = count;
+	s->fr.datalen = count * sizeof(short);
+	return &s->fr;
+}
+
+/* Frames are written as they come, a frame of silence as a silence run */
+static int esr_write(struct ast_filestream *s, struct ast_frame *f)
+{
+	struct compact_reader *reader = s->_private;
+	const short *data = f->data.ptr;
+	int samples = f->datalen / sizeof(short);
+	int i;
+
+	for (i = 0; i < samples && abs(data[i]) <= silence_threshold; i++)
+		;
+	if (compact_record(s->f, data, samples, samples && i == samples)) {
+		ast_log(LOG_WARNING, "eSpeak: Failed to write %s file\n", s->fmt->name);
+		return -1;
+	}
+	reader->pos += samples;
+	return 0;
+}
+
+/* Seek by sample offset. Earlier positions are reached again from the
+ * start of the file, skipping records. */
+static int esr_seek(struct ast_filestream *s, off_t sample_offset, int whence)
+{
+	struct compact_reader *reader = s->_private;
+	off_t target;
+
+	if (whence == SEEK_END) {
+		if (compact_skip(reader, -1))
+			return -1;
+		target = reader->pos + sample_offset;
+	} else {
+		target = whence == SEEK_SET ? sample_offset : reader->pos + sample_offset;
+	}
+	if (target < 0)
+		target = 0;
+	if (target < reader->pos) {
+		if (fseeko(s->f, COMPACT_HEADER, SEEK_SET))
+			return -1;
+		reader->audio = reader->silence = 0;
+		reader->pos = 0;
+	}
+	return compact_skip(reader, target - reader->pos);
+}
+
+/* Cutting a record short would need it rewritten, not supported */
+static int esr_trunc(struct ast_filestream *s)
+{
+	(void) s;
+	return -1;
+}
+
+static off_t esr_tell(struct ast_filestream *s)
+{
+	struct compact_reader *reader = s->_private;
+
+	return reader->pos;
+}
+
+static struct ast_format_def esr_f = {
+	.name = "esr",
+	.exts = "esr",
+	.open = esr_open,
+	.rewrite = esr_rewrite,
+	.write = esr_write,
+	.seek = esr_seek,
+	.trunc = esr_trunc,
+	.tell = esr_tell,
+	.read = esr_read,
+	.buf_size = 8000 * COMPACT_FRAME_MS / 1000 * sizeof(short) + AST_FRIENDLY_OFFSET,
+	.desc_size = sizeof(struct compact_reader),
+};
+
+static struct ast_format_def esr16_f = {
+	.name = "esr16",
+	.exts = "esr16",
+	.open = esr_open,
+	.rewrite = esr_rewrite,
+	.write = esr_write,
+	.seek = esr_seek,
+	.trunc = esr_trunc,
+	.tell = esr_tell,
+	.read = esr_read,
+	.buf_size = 16000 * COMPACT_FRAME_MS / 1000 * sizeof(short) + AST_FRIENDLY_OFFSET,
+	.desc_size = sizeof(struct compact_reader),
+};
+
+/* Write audio to name.<format>, compacted with compactsilence=yes,
+ * through a temporary file */
+static int pcm_write(const struct ast_espeak_pcm *pcm, const char *name)
+{
+	FILE *fl;
+	char tmp_name[MAXLEN + 8];
+	char final_name[MAXLEN + 8];
+	int compact = compactsilence;
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+	snprintf(final_name, sizeof(final_name), "%s.%s", name,
+			compact ? compact_format(pcm->rate) : pcm_format(pcm));
+	if ((fl = fopen(tmp_name, "w")) == NULL) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to open audio file '%s'\n", tmp_name);
+		return -1;
+	}
+	if (compact ? compact_fwrite(pcm, fl) : pcm_fwrite(pcm, fl)) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to write audio file '%s'\n", tmp_name);
+		fclose(fl);
+		unlink(tmp_name);
+		return -1;
+	}
+	fclose(fl);
+	if (rename(tmp_name, final_name)) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to rename audio file '%s'\n", tmp_name);
+		unlink(tmp_name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Read audio at the target sample rate from a silence-compacted file */
+static struct ast_espeak_pcm *compact_read(const char *name)
+{
+	struct compact_reader reader = { NULL, };
+	struct ast_espeak_pcm *pcm;
+	short buf[STREAM_MAX_SAMPLES];
+	char fname[MAXLEN + 8];
+	int count;
+
+	if (!(pcm = pcm_alloc(target_sample_rate)))
+		return NULL;
+	snprintf(fname, sizeof(fname), "%s.%s", name, compact_format(pcm->rate));
+	if ((reader.fl = fopen(fname, "r")) == NULL) {
+		ao2_ref(pcm, -1);
+		return NULL;
+	}
+	if (compact_read_header(reader.fl, pcm->rate)) {
+		count = -1;
+	} else {
+		while ((count = compact_decode(&reader, buf, STREAM_MAX_SAMPLES)) > 0) {
+			if (pcm_append(pcm, buf, count)) {
+				count = -1;
+				break;
+			}
+		}
+	}
+	fclose(reader.fl);
+	if (count < 0) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to read audio file '%s'\n", fname);
+		ao2_ref(pcm, -1);
+		return NULL;
+	}
+	return pcm;
+}
+
+/* Read audio at the target sample rate from name.<format>, or its
+ * compacted version */
+static struct ast_espeak_pcm *pcm_read(const char *name)
+{
+	FILE *fl;
+	struct stat st;
+	struct ast_espeak_pcm *pcm;
+	char fname[MAXLEN + 8];
+
+	if (!(pcm = pcm_alloc(target_sample_rate)))
+		return NULL;
+	snprintf(fname, sizeof(fname), "%s.%s", name, pcm_format(pcm));
+	if ((fl = fopen(fname, "r")) == NULL) {
+		ao2_ref(pcm, -1);
+		return compact_read(name);
+	}
+	if (fstat(fileno(fl), &st) == -1 || !(pcm->data = ast_malloc(st.st_size))) {
+		fclose(fl);
+		ao2_ref(pcm, -1);
+		return NULL;
+	}
+	pcm->allocated = st.st_size / sizeof(short);
+	pcm->samples = fread(pcm->data, sizeof(short), pcm->allocated, fl);
+	fclose(fl);
+	if (pcm->samples != pcm->allocated) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to read audio file '%s'\n", fname);
+		ao2_ref(pcm, -1);
+		return NULL;
+	}
+	return pcm;
+}
+
+/* Sample format conversion kernels. They are compiled for several
+ * instruction sets and the fastest one supported by the CPU is picked
+ * at load time by dsp_select(). */
+#define DSP_KERNELS(isa, attr) \
+static attr void s16_to_float_##isa(const short *in, float *out, int len) \
+{ \
+	int i; \
+	for (i = 0; i < len; i++) \
+		out[i] = in[i] * (1.0f / 32768); \
+} \
+static attr void float_to_s16_##isa(const float *in, short *out, int len) \
+{ \
+	int i, v; \
+	for (i = 0; i < len; i++) { \
+		v = (int) (in[i] * 32768 + (in[i] < 0 ? -0.5f : 0.5f)); \
+		out[i] = v > 32767 ? 32767 : v < -32768 ? -32768 : v; \
+	} \
+}
+
+DSP_KERNELS(generic, )
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DSP_X86
+DSP_KERNELS(avx2, __attribute__((target("avx2"))))
+DSP_KERNELS(avx512, __attribute__((target("avx512f,avx512bw"))))
+
+static int dsp_has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int dsp_has_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+static int dsp_has_generic(void)
+{
+	return 1;
+}
+
+struct dsp_kernel {
+	const char *name;
+	int (*supported)(void);
+	void (*s16_to_float)(const short *in, float *out, int len);
+	void (*float_to_s16)(const float *in, short *out, int len);
+};
+
+static const struct dsp_kernel dsp_kernels[] = {
+	{ "generic", dsp_has_generic, s16_to_float_generic, float_to_s16_generic },
+#ifdef DSP_X86
+	{ "avx2", dsp_has_avx2, s16_to_float_avx2, float_to_s16_avx2 },
+	{ "avx512", dsp_has_avx512, s16_to_float_avx512, float_to_s16_avx512 },
+#endif
+};
+
+static const struct dsp_kernel *dsp_s16_to_float = &dsp_kernels[0];
+static const struct dsp_kernel *dsp_float_to_s16 = &dsp_kernels[0];
+/* Keeps benchmark loops from being optimized away */
+static volatile short dsp_bench_sink;
+
+/* Best time of a few runs of a conversion kernel, in microseconds */
+static int64_t dsp_bench(const struct dsp_kernel *kernel, int to_float, short *s, float *f)
+{
+	int64_t best = INT64_MAX, elapsed;
+	struct timeval start;
+	int run, loop;
+
+	for (run = 0; run < DSP_BENCH_RUNS; run++) {
+		start = ast_tvnow();
+		for (loop = 0; loop < DSP_BENCH_LOOPS; loop++) {
+			if (to_float) {
+				kernel->s16_to_float(s, f, DSP_BENCH_SAMPLES);
+			} else {
+				kernel->float_to_s16(f, s, DSP_BENCH_SAMPLES);
+			}
+		}
+		elapsed = ast_tvdiff_us(ast_tvnow(), start);
+		best = MIN(best, elapsed);
+		dsp_bench_sink = s[DSP_BENCH_SAMPLES - 1];
+	}
+	return best;
+}
+
+/* Pick the fastest kernel variants this CPU supports */
+static void dsp_select(void)
+{
+	short *s;
+	float *f;
+	int64_t best_in = INT64_MAX, best_out = INT64_MAX, elapsed;
+	size_t i;
+
+	s = ast_malloc(DSP_BENCH_SAMPLES * sizeof(*s));
+	f = ast_malloc(DSP_BENCH_SAMPLES * sizeof(*f));
+	if (!s || !f) {
+		ast_free(s);
+		ast_free(f);
+		return;
+	}
+	for (i = 0; i < DSP_BENCH_SAMPLES; i++)
+		s[i] = (short) (i * 7919);
+#ifdef DSP_X86
+	__builtin_cpu_init();
+#endif
+	for (i = 0; i < ARRAY_LEN(dsp_kernels); i++) {
+		if (!dsp_kernels[i].supported())
+			continue;
+		if ((elapsed = dsp_bench(&dsp_kernels[i], 1, s, f)) < best_in) {
+			best_in = elapsed;
+			dsp_s16_to_float = &dsp_kernels[i];
+		}
+		if ((elapsed = dsp_bench(&dsp_kernels[i], 0, s, f)) < best_out) {
+			best_out = elapsed;
+			dsp_float_to_s16 = &dsp_kernels[i];
+		}
+		ast_debug(1, "eSpeak: %s kernels supported\n", dsp_kernels[i].name);
+	}
+	ast_free(s);
+	ast_free(f);
+	ast_debug(1, "eSpeak: Using %s s16->float and %s float->s16 kernels\n",
+			dsp_s16_to_float->name, dsp_float_to_s16->name);
+}
+
+static int latency_cmp(const void *a, const void *b)
+{
+	int64_t left = *(const int64_t *) a;
+	int64_t right = *(const int64_t *) b;
+
+	return left < right ? -1 : left > right;
+}
+
+/* Record the time to first audio of a streamed synthesis */
+static void first_audio_add(int64_t elapsed_ms)
+{
+	ast_mutex_lock(&stats_lock);
+	first_audio[first_audio_count++ % HEDGE_HISTORY] = elapsed_ms;
+	ast_mutex_unlock(&stats_lock);
+}
+
+/* Percentile of recent times to first audio, -1 without enough history.
+ * Must be called with stats_lock held. */
+static int64_t first_audio_percentile(int percentile)
+{
+	int64_t sorted[HEDGE_HISTORY];
+	unsigned int count = MIN(first_audio_count, HEDGE_HISTORY);
+
+	if (count < HEDGE_MIN_HISTORY)
+		return -1;
+	memcpy(sorted, first_audio, count * sizeof(*sorted));
+	qsort(sorted, count, sizeof(*sorted), latency_cmp);
+	return sorted[MIN(count * percentile / 100, count - 1)];
+}
+
+/* A synthesis in progress that late callers can listen to while it runs */
+struct espeak_flight {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	/* Audio produced so far, grows under lock */
+	struct ast_espeak_pcm *pcm;
+	/* 1 when finished, -1 on failure */
+	int done;
+	struct timeval start;
+	/* Producer whose audio is used, the first one to answer */
+	int owner;
+	/* Producers still running */
+	int producers;
+	/* Set once a hedge has been considered */
+	int hedged;
+	/* Set when a failed hedge handed the flight back to the engine */
+	int reclaimed;
+	/* Set for syntheses of a replay */
+	struct replay *replay;
+	const char *text;
+	const char *voice;
+	/* "voice|text" */
+	char key[0];
+};
+
+/* Output of a synthesis run */
+struct synth_sink {
+	struct ast_espeak_pcm *pcm;
+	/* Set when streaming to listeners */
+	struct espeak_flight *flight;
+	/* Set when resampling */
+	SRC_STATE *src;
+	double ratio;
+	/* PRODUCER_ENGINE or PRODUCER_HEDGE */
+	int producer;
+	/* Set when another producer answered first */
+	int lost;
+	/* Samples offered so far. A producer taking a flight back skips
+	 * what listeners already got. */
+	size_t produced;
+	/* Set when copying from the cache, which does not count as time to
+	 * first audio */
+	int cached;
+	/* Set for background fills, which stop when a caller wants the engine */
+	int background;
+	/* Set when a background fill stopped early */
+	int aborted;
+};
+
+/* Append audio to the sink. When streaming, the first producer to append
+ * takes over the flight and later appends by others fail. */
+static int sink_append(struct synth_sink *sink, const short *samples, size_t count)
+{
+	struct espeak_flight *flight = sink->flight;
+	int res = 0;
+
+	if (!flight)
+		return pcm_append(sink->pcm, samples, count);
+	ast_mutex_lock(&flight->lock);
+	if (!flight->owner)
+		flight->owner = sink->producer;
+	if (flight->owner != sink->producer) {
+		sink->lost = 1;
+		ast_mutex_unlock(&flight->lock);
+		return -1;
+	}
+	if (count) {
+		size_t skip = sink->pcm->samples > sink->produced ? sink->pcm->samples - sink->produced : 0;
+
+		sink->produced += count;
+		if (!sink->pcm->samples && !sink->cached && !flight->replay)
+			first_audio_add(ast_tvdiff_ms(ast_tvnow(), flight->start));
+		if (skip < count)
+			res = pcm_append(sink->pcm, samples + skip, count - skip);
+	}
+	ast_cond_broadcast(&flight->cond);
+	ast_mutex_unlock(&flight->lock);
+	return res;
+}
+
+/* Resample a chunk of engine output if needed and append it to the sink.
+ * The last call flushes the resampler. */
+static int sink_write(struct synth_sink *sink, const short *wav, long count, int last)
+{
+	int res = 0;
+	int err;
+	short *out_buff = NULL;
+	long out_frames;
+	float *inp = NULL, *outp = NULL;
+	SRC_DATA rate_change;
+
+	if (!sink->src)
+		return count ? sink_append(sink, wav, count) : 0;
+
+	out_frames = (long)((double)count * sink->ratio) + 64;
+	if ((inp = (float *)(ast_malloc(MAX(count, 1) * sizeof(float)))) == NULL
+			|| (outp = (float *)(ast_malloc(out_frames * sizeof(float)))) == NULL
+			|| (out_buff = ast_malloc(out_frames * sizeof(short))) == NULL) {
+		res = -1;
+		goto CLEAN;
+	}
+	dsp_s16_to_float->s16_to_float(wav, inp, count);
+	rate_change.data_in = inp;
+	rate_change.input_frames = count;
+	rate_change.end_of_input = last;
+	rate_change.src_ratio = sink->ratio;
+	do {
+		rate_change.data_out = outp;
+		rate_change.output_frames = out_frames;
+		if ((err = src_process(sink->src, &rate_change)) != 0) {
+			ast_log(LOG_ERROR, "eSpeak: Failed to resample sound data: '%s'\n",
+					src_strerror(err));
+			res = -1;
+			break;
+		}
+		dsp_float_to_s16->float_to_s16(outp, out_buff, rate_change.output_frames_gen);
+		if (rate_change.output_frames_gen
+				&& sink_append(sink, out_buff, rate_change.output_frames_gen)) {
+			res = -1;
+			break;
+		}
+		rate_change.data_in += rate_change.input_frames_used;
+		rate_change.input_frames -= rate_change.input_frames_used;
+	} while ((rate_change.input_frames > 0
+				&& (rate_change.input_frames_used > 0 || rate_change.output_frames_gen > 0))
+			|| (last && rate_change.output_frames_gen > 0));
+CLEAN:
+	ast_free(out_buff);
+	ast_free(outp);
+	ast_free(inp);
+	return res;
+}
+
+/* espeak synthesis callback function */
+static int synth_callback(short *wav, int numsamples, espeak_EVENT *events)
+{
+	struct synth_sink *sink = events[0].user_data;
+
+	if (sink->background && engine_wanted()) {
+		sink->aborted = 1;
+		return 1; /* Give way to a caller */
+	}
+	if (wav) {
+		if (!sink_write(sink, wav, numsamples, 0))
+			return 0; /* Continue synthesis */
+	}
+	return 1; /* Stop synthesis */
+}
+
+/* Cache file name of a text, without extension. Replays use their
+ * scratch cache. */
+static int cache_name(char *name, size_t len, const char *text, const char *voice,
+		const struct replay *replay)
+{
+	const char *dir = replay ? replay->cachedir : cachedir;
+	char MD5_name[33];
+	char *key;
+
+	if (!usecache)
+		return -1;
+	key = ast_alloca(strlen(voice) + strlen(text) + 2);
+	sprintf(key, "%s|%s", voice, text);
+	ast_md5_hash(MD5_name, key);
+	if (strlen(dir) + strlen(MD5_name) + 6 > len)
+		return -1;
+	snprintf(name, len, "%s/%s", dir, MD5_name);
+	return 0;
+}
+
+static int cache_lookup(const char *text, const char *voice, char *path, size_t len,
+		const struct replay *replay)
+{
+	if (ast_strlen_zero(voice))
+		voice = def_voice;
+	if (cache_name(path, len, text, voice, replay))
+		return -1;
+	return ast_fileexists(path, NULL, NULL) > 0 ? 0 : -1;
+}
+
+int ast_espeak_cache_lookup(const char *text, const char *voice, char *path, size_t len)
+{
+	return cache_lookup(text, voice, path, len, NULL);
+}
+
+/* Run the engine on a text, appending the audio to pcm at the target
+ * sample rate. Must be called with engine_lock held. Returns -2 if a
+ * background run gave way to a caller. */
+static int engine_synth(const char *text, const char *voice, int converter,
+		struct ast_espeak_pcm *pcm, struct espeak_flight *flight, int background)
+{
+	int err;
+	espeak_ERROR espk_error;
+	struct synth_sink sink = {
+		.pcm = pcm,
+		.flight = flight,
+		.ratio = (double) pcm->rate / engine_rate,
+		.producer = PRODUCER_ENGINE,
+		.background = background,
+	};
+
+	if (strcmp(voice, engine_voice)) {
+		if (espeak_SetVoiceByName(voice) != EE_OK) {
+			ast_log(LOG_ERROR, "eSpeak: Failed to set voice=%s.\n", voice);
+			return -1;
+		}
+		ast_copy_string(engine_voice, voice, sizeof(engine_voice));
+	}
+	if ( espeak_SetParameter(espeakRATE, speed, 0) != EE_OK ) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to set speed=%d.\n", speed);
+		return -1;
+	}
+	if ( espeak_SetParameter(espeakVOLUME, volume, 0) != EE_OK ) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to set volume=%d.\n", volume);
+		return -1;
+	}
+	if ( espeak_SetParameter(espeakWORDGAP, wordgap, 0) != EE_OK ) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to set wordgap=%d.\n", wordgap);
+		return -1;
+	}
+	if ( espeak_SetParameter(espeakPITCH, pitch, 0) != EE_OK ) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to set pitch=%d.\n", pitch);
+		return -1;
+	}
+	if ( espeak_SetParameter(espeakCAPITALS, capind, 0) != EE_OK ) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to set capind=%d.\n", capind);
+		return -1;
+	}
+
+	/* Sound data is resampled as it is produced */
+	if (pcm->rate != (unsigned int) engine_rate
+			&& !(sink.src = src_new(converter, 1, &err))) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to create resampler: '%s'\n", src_strerror(err));
+		return -1;
+	}
+	espk_error = espeak_Synth(text, strlen(text), 0, POS_CHARACTER,
+			(int) strlen(text), espeakCHARS_AUTO, NULL, &sink);
+	if (sink.aborted) {
+		if (sink.src)
+			src_delete(sink.src);
+		ast_debug(1, "eSpeak: Background synthesis stopped for a waiting caller.\n");
+		return -2;
+	}
+	if (espk_error == EE_OK && (sink_write(&sink, NULL, 0, 1)
+			|| (flight && sink_append(&sink, NULL, 0))))
+		espk_error = EE_INTERNAL_ERROR;
+	if (sink.src)
+		src_delete(sink.src);
+	if (sink.lost) {
+		ast_debug(1, "eSpeak: Synthesis cancelled, the hedge answered first.\n");
+		return -1;
+	}
+	if (espk_error != EE_OK) {
+		ast_log(LOG_ERROR,
+				"eSpeak: Failed to synthesize speech for the specified text.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Synthesize into pcm with load accounting and single-flight cache
+ * filling. Returns 1 if the audio was taken from the cache, -2 if a
+ * background run gave way to a caller. */
+static int synth_run(const char *text, const char *voice, struct ast_espeak_pcm *pcm,
+		struct espeak_flight *flight, int background, struct replay *replay)
+{
+	struct ast_espeak_pcm *cached;
+	struct synth_sink sink = {
+		.pcm = pcm,
+		.flight = flight,
+		.producer = PRODUCER_ENGINE,
+	};
+	char cachefile[MAXLEN];
+	int tier;
+	int res;
+	int lost = 0;
+	int spliced = 0;
+	struct timeval start;
+
+	/* Everyone waiting for the engine counts as load */
+	tier = synth_begin(replay);
+	engine_acquire(background, replay);
+	/* A hedge may have answered while we were waiting */
+	if (flight) {
+		ast_mutex_lock(&flight->lock);
+		lost = flight->owner && flight->owner != PRODUCER_ENGINE;
+		ast_mutex_unlock(&flight->lock);
+	}
+	if (lost) {
+		ast_mutex_unlock(&engine_lock);
+		synth_end(replay, 0, 0);
+		return -1;
+	}
+	/* The same text may have been synthesized while we were waiting */
+	if (!cache_lookup(text, voice, cachefile, sizeof(cachefile), replay)
+			&& (cached = pcm_read(cachefile))) {
+		ast_mutex_unlock(&engine_lock);
+		synth_end(replay, 0, 0);
+		sink.cached = 1;
+		res = sink_append(&sink, cached->data, cached->samples);
+		ao2_ref(cached, -1);
+		if (!replay) {
+			ast_mutex_lock(&stats_lock);
+			cache_hits++;
+			ast_mutex_unlock(&stats_lock);
+		}
+		return res ? -1 : 1;
+	}
+	start = ast_tvnow();
+	res = engine_synth(text, voice, degrade_tiers[tier].converter, pcm, flight, background);
+	if (flight) {
+		ast_mutex_lock(&flight->lock);
+		spliced = flight->reclaimed;
+		ast_mutex_unlock(&flight->lock);
+	}
+	/* Degraded audio is not kept, an unloaded run renders it properly */
+	if (!res && tier && pcm->rate != (unsigned int) engine_rate) {
+		ast_debug(1, "eSpeak: Not caching audio rendered at the %s tier\n",
+				degrade_tiers[tier].name);
+	} else if (!res && spliced) {
+		ast_debug(1, "eSpeak: Not caching audio taken over from a failed hedge\n");
+	} else if (!res && !cache_name(cachefile, sizeof(cachefile), text, voice, replay)) {
+		ast_debug(1, "eSpeak: Saving cache file %s\n", cachefile);
+		pcm_write(pcm, cachefile);
+	}
+	ast_mutex_unlock(&engine_lock);
+	synth_end(replay, ast_tvdiff_ms(ast_tvnow(), start),
+			res ? 0 : (int64_t) pcm->samples * 1000 / pcm->rate);
+	return res;
+}
+
+static int flight_hash_fn(const void *obj, const int flags)
+{
+	const struct espeak_flight *flight;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		flight = obj;
+		key = flight->key;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int flight_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct espeak_flight *left = obj;
+	const struct espeak_flight *right = arg;
+	const char *right_key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		right_key = right->key;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		break;
+	default:
+		return 0;
+	}
+	return strcmp(left->key, right_key) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+/* The flights a request may join, replays keep their own */
+static struct ao2_container *flight_container(const struct replay *replay)
+{
+	return replay ? replay->flights : flights;
+}
+
+static void flight_destructor(void *obj)
+{
+	struct espeak_flight *flight = obj;
+
+	ao2_cleanup(flight->pcm);
+	ao2_cleanup(flight->replay);
+	ast_cond_destroy(&flight->cond);
+	ast_mutex_destroy(&flight->lock);
+}
+
+/* A producer of the flight is done. The flight finishes with the
+ * producer that answered first, or fails when all producers failed.
+ * A hedge that fails after taking the flight over hands it back to the
+ * engine, which gave way to it. */
+static void flight_finish(struct espeak_flight *flight, int producer, int res)
+{
+	int finished = 0;
+
+	ast_mutex_lock(&flight->lock);
+	flight->producers--;
+	if (!res && !flight->owner)
+		flight->owner = producer;
+	if (flight->owner == producer && res && producer == PRODUCER_HEDGE && flight->producers) {
+		flight->owner = 0;
+		flight->reclaimed = 1;
+	} else if (flight->owner == producer) {
+		flight->done = res ? -1 : 1;
+		finished = 1;
+	} else if (!flight->owner && !flight->producers) {
+		flight->done = -1;
+		finished = 1;
+	}
+	ast_cond_broadcast(&flight->cond);
+	ast_mutex_unlock(&flight->lock);
+	if (finished) {
+		if (producer == PRODUCER_HEDGE && !res && !flight->replay) {
+			ast_mutex_lock(&stats_lock);
+			hedge_wins++;
+			ast_mutex_unlock(&stats_lock);
+		}
+		/* New callers find the audio in the cache from now on */
+		ao2_unlink(flight_container(flight->replay), flight);
+	}
+}
+
+/* A hedge of a flight, with the settings it was started with. They are
+ * copied because a reload frees the configuration. */
+struct hedge_job {
+	struct espeak_flight *flight;
+	char speed[12];
+	char volume[12];
+	char wordgap[12];
+	char pitch[12];
+	char capind[12];
+	char command[0];
+};
+
+/* Duplicate of a late synthesis, run by the espeak command line tool */
+static void *hedge_thread(void *data)
+{
+	struct hedge_job *job = data;
+	struct espeak_flight *flight = job->flight;
+	struct synth_sink sink = {
+		.pcm = flight->pcm,
+		.flight = flight,
+		.producer = PRODUCER_HEDGE,
+	};
+	char cachefile[MAXLEN];
+	unsigned char header[44];
+	short buf[HEDGE_CHUNK];
+	size_t have, count;
+	ssize_t len;
+	unsigned int rate = 0;
+	int in[2], out[2];
+	int tier, err, status;
+	int res = -1;
+	pid_t pid;
+
+	tier = synth_begin(flight->replay);
+	if (pipe(in))
+		goto END;
+	if (pipe(out)) {
+		close(in[0]);
+		close(in[1]);
+		goto END;
+	}
+	if ((pid = ast_safe_fork(1)) < 0) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to fork hedge process\n");
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		goto END;
+	}
+	if (!pid) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		ast_close_fds_above_n(STDERR_FILENO);
+		execlp(job->command, job->command, "--stdout", "-v", flight->voice,
+				"-s", job->speed, "-a", job->volume, "-g", job->wordgap,
+				"-p", job->pitch, "-k", job->capind, (char *) NULL);
+		_exit(1);
+	}
+	close(in[0]);
+	close(out[1]);
+	if (write(in[1], flight->text, strlen(flight->text)) < 0)
+		ast_log(LOG_WARNING, "eSpeak: Failed to pass text to hedge process\n");
+	close(in[1]);
+
+	/* Output is a WAV stream with a 44 byte header */
+	for (have = 0; have < sizeof(header); have += len) {
+		if ((len = read(out[0], header + have, sizeof(header) - have)) < 0 && errno == EINTR)
+			len = 0;
+		else if (len <= 0)
+			break;
+	}
+	if (have == sizeof(header) && !memcmp(header, "RIFF", 4)) {
+		rate = header[24] | header[25] << 8 | header[26] << 16 | (unsigned int) header[27] << 24;
+		sink.ratio = (double) sink.pcm->rate / rate;
+		if (rate == sink.pcm->rate || (sink.src = src_new(degrade_tiers[tier].converter, 1, &err))) {
+			res = 0;
+			/* Pass on whatever has arrived, so the hedge answers as soon as it can */
+			have = 0;
+			while ((len = read(out[0], (char *) buf + have, sizeof(buf) - have)) != 0) {
+				if (len < 0) {
+					if (errno == EINTR)
+						continue;
+					res = -1;
+					break;
+				}
+				have += len;
+				if ((count = have / sizeof(short)) && sink_write(&sink, buf, count, 0)) {
+					res = -1;
+					break;
+				}
+				/* Keep an odd byte for the next read */
+				have -= count * sizeof(short);
+				memmove(buf, (char *) buf + count * sizeof(short), have);
+			}
+			if (!res && (sink_write(&sink, NULL, 0, 1) || sink_append(&sink, NULL, 0)))
+				res = -1;
+		}
+	}
+	if (res)
+		kill(pid, SIGTERM);
+	close(out[0]);
+	waitpid(pid, &status, 0);
+	ast_safe_fork_cleanup();
+	if (!res && (!WIFEXITED(status) || WEXITSTATUS(status)))
+		res = -1;
+	if (sink.src)
+		src_delete(sink.src);
+	/* Degraded audio is not kept, an unloaded run renders it properly */
+	if (!res && tier && rate != sink.pcm->rate) {
+		ast_debug(1, "eSpeak: Not caching hedge audio rendered at the %s tier\n",
+				degrade_tiers[tier].name);
+	} else if (!res && !cache_name(cachefile, sizeof(cachefile), flight->text, flight->voice,
+			flight->replay)) {
+		ast_debug(1, "eSpeak: Saving cache file %s\n", cachefile);
+		pcm_write(sink.pcm, cachefile);
+	}
+
+END:
+	synth_end(flight->replay, 0, 0);
+	if (res && !sink.lost)
+		ast_log(LOG_WARNING, "eSpeak: Hedge synthesis with %s failed\n", job->command);
+	flight_finish(flight, PRODUCER_HEDGE, res);
+	ast_mutex_lock(&stats_lock);
+	hedges_running--;
+	ast_mutex_unlock(&stats_lock);
+	ao2_ref(flight, -1);
+	ast_free(job);
+	return NULL;
+}
+
+/* Spend a hedge token, replays have a budget of their own. Returns 1
+ * and counts the hedge as running if one was left. */
+static int hedge_take(struct replay *replay)
+{
+	int res = 0;
+
+	if (replay) {
+		ast_mutex_lock(&replay->lock);
+		if (replay->hedge_tokens >= 1) {
+			replay->hedge_tokens -= 1;
+			replay->hedges++;
+			res = 1;
+		}
+		ast_mutex_unlock(&replay->lock);
+	} else {
+		ast_mutex_lock(&stats_lock);
+		if (hedge_tokens >= 1) {
+			hedge_tokens -= 1;
+			hedges++;
+			res = 1;
+		}
+		ast_mutex_unlock(&stats_lock);
+	}
+	/* Replay hedges count too, unloading waits for them */
+	if (res) {
+		ast_mutex_lock(&stats_lock);
+		hedges_running++;
+		ast_mutex_unlock(&stats_lock);
+	}
+	return res;
+}
+
+/* Start a hedge for a flight whose first audio is later than the
+ * configured percentile of recent first audio times */
+static void flight_hedge(struct espeak_flight *flight)
+{
+	struct hedge_job *job;
+	pthread_t thread;
+	int64_t deadline;
+	int start = 0;
+
+	if (!hedge)
+		return;
+	ast_mutex_lock(&flight->lock);
+	if (flight->hedged || flight->done || flight->owner) {
+		ast_mutex_unlock(&flight->lock);
+		return;
+	}
+	ast_mutex_lock(&stats_lock);
+	deadline = first_audio_percentile(hedge_percentile);
+	ast_mutex_unlock(&stats_lock);
+	if (deadline >= 0 && ast_tvdiff_ms(ast_tvnow(), flight->start) > deadline) {
+		/* Only one chance per flight, skipped when over budget */
+		flight->hedged = 1;
+		start = hedge_take(flight->replay);
+	}
+	if (start) {
+		ast_debug(1, "eSpeak: No audio after %" PRId64 " ms, hedging\n", deadline);
+		if ((job = ast_calloc(1, sizeof(*job) + strlen(hedge_command) + 1))) {
+			job->flight = flight;
+			snprintf(job->speed, sizeof(job->speed), "%d", speed);
+			snprintf(job->volume, sizeof(job->volume), "%d", volume);
+			snprintf(job->wordgap, sizeof(job->wordgap), "%d", wordgap);
+			snprintf(job->pitch, sizeof(job->pitch), "%d", pitch);
+			snprintf(job->capind, sizeof(job->capind), "%d", capind);
+			strcpy(job->command, hedge_command);
+			flight->producers++;
+			ao2_ref(flight, +1);
+		}
+		if (!job || ast_pthread_create_detached(&thread, NULL, hedge_thread, job)) {
+			if (job) {
+				flight->producers--;
+				ao2_ref(flight, -1);
+				ast_free(job);
+			}
+			ast_mutex_lock(&stats_lock);
+			hedges_running--;
+			ast_mutex_unlock(&stats_lock);
+		}
+	}
+	ast_mutex_unlock(&flight->lock);
+}
+
+/* Wait for a hedge that took the flight over from the engine. Returns 1
+ * if it failed and handed the flight back. */
+static int flight_reclaim(struct espeak_flight *flight)
+{
+	int reclaimed;
+
+	ast_mutex_lock(&flight->lock);
+	while (flight->owner == PRODUCER_HEDGE && !flight->done)
+		ast_cond_wait(&flight->cond, &flight->lock);
+	reclaimed = flight->reclaimed && !flight->done;
+	ast_mutex_unlock(&flight->lock);
+	return reclaimed;
+}
+
+/* Producer of a streamed synthesis */
+static void *flight_thread(void *data)
+{
+	struct espeak_flight *flight = data;
+	int res;
+
+	res = synth_run(flight->text, flight->voice, flight->pcm, flight, 0, flight->replay);
+	/* Listeners keep what the failed hedge delivered, the engine goes on from there */
+	if (res < 0 && flight_reclaim(flight)) {
+		ast_debug(1, "eSpeak: Hedge failed, taking the synthesis back\n");
+		res = synth_run(flight->text, flight->voice, flight->pcm, flight, 0, flight->replay);
+	}
+	flight_finish(flight, PRODUCER_ENGINE, res < 0 ? -1 : 0);
+	ao2_ref(flight, -1);
+	return NULL;
+}
+
+/* Find the synthesis of a text in progress, or start one.
+ * Returns a reference, joined is set if it was already running. */
+static struct espeak_flight *flight_get(const char *text, const char *voice, int *joined,
+		struct replay *replay)
+{
+	struct ao2_container *container = flight_container(replay);
+	struct espeak_flight *flight;
+	pthread_t thread;
+	char *key;
+
+	key = ast_alloca(strlen(voice) + strlen(text) + 2);
+	sprintf(key, "%s|%s", voice, text);
+	ao2_lock(container);
+	if ((flight = ao2_find(container, key, OBJ_SEARCH_KEY | OBJ_NOLOCK))) {
+		ao2_unlock(container);
+		*joined = 1;
+		if (!replay) {
+			ast_mutex_lock(&stats_lock);
+			stream_joins++;
+			ast_mutex_unlock(&stats_lock);
+		}
+		return flight;
+	}
+	*joined = 0;
+	if (!(flight = ao2_alloc(sizeof(*flight) + 2 * strlen(key) + 2, flight_destructor))) {
+		ao2_unlock(container);
+		return NULL;
+	}
+	ast_mutex_init(&flight->lock);
+	ast_cond_init(&flight->cond, NULL);
+	flight->start = ast_tvnow();
+	flight->producers = 1;
+	if ((flight->replay = replay))
+		ao2_ref(replay, +1);
+	strcpy(flight->key, key);
+	flight->text = flight->key + strlen(voice) + 1;
+	flight->voice = strcpy(flight->key + strlen(key) + 1, voice);
+	if (!(flight->pcm = pcm_alloc(target_sample_rate))) {
+		ao2_unlock(container);
+		ao2_ref(flight, -1);
+		return NULL;
+	}
+	ao2_link_flags(container, flight, OBJ_NOLOCK);
+	ao2_ref(flight, +1);
+	if (replay) {
+		ast_mutex_lock(&replay->lock);
+		replay->hedge_tokens = MIN(replay->hedge_tokens + hedge_budget / 100.0, HEDGE_MAX_TOKENS);
+		ast_mutex_unlock(&replay->lock);
+	} else {
+		ast_mutex_lock(&stats_lock);
+		hedge_tokens = MIN(hedge_tokens + hedge_budget / 100.0, HEDGE_MAX_TOKENS);
+		ast_mutex_unlock(&stats_lock);
+	}
+	if (ast_pthread_create_detached(&thread, NULL, flight_thread, flight)) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to start synthesis thread\n");
+		ao2_unlink_flags(container, flight, OBJ_NOLOCK);
+		ao2_unlock(container);
+		ao2_ref(flight, -2);
+		return NULL;
+	}
+	ao2_unlock(container);
+	return flight;
+}
+
+/* Synthesize or fetch from the cache, cached is set on cache hits */
+static struct ast_espeak_pcm *espeak_synth(const char *text, const char *voice, int *cached,
+		struct replay *replay)
+{
+	struct ast_espeak_pcm *pcm;
+	struct espeak_flight *flight;
+	char cachefile[MAXLEN];
+	char *key;
+	int res;
+
+	*cached = 1;
+	if (!cache_lookup(text, voice, cachefile, sizeof(cachefile), replay)
+			&& (pcm = pcm_read(cachefile))) {
+		if (!replay) {
+			ast_mutex_lock(&stats_lock);
+			cache_hits++;
+			ast_mutex_unlock(&stats_lock);
+		}
+		return pcm;
+	}
+
+	/* Wait for a streamed synthesis of the same text instead of repeating it */
+	key = ast_alloca(strlen(voice) + strlen(text) + 2);
+	sprintf(key, "%s|%s", voice, text);
+	if ((flight = ao2_find(flight_container(replay), key, OBJ_SEARCH_KEY))) {
+		ast_mutex_lock(&flight->lock);
+		while (!flight->done) {
+			struct timeval wait = ast_tvadd(ast_tvnow(), ast_tv(0, 100000));
+			struct timespec ts = {
+				.tv_sec = wait.tv_sec,
+				.tv_nsec = wait.tv_usec * 1000,
+			};
+
+			ast_cond_timedwait(&flight->cond, &flight->lock, &ts);
+			ast_mutex_unlock(&flight->lock);
+			flight_hedge(flight);
+			ast_mutex_lock(&flight->lock);
+		}
+		pcm = flight->done > 0 ? ao2_bump(flight->pcm) : NULL;
+		ast_mutex_unlock(&flight->lock);
+		ao2_ref(flight, -1);
+		*cached = 0;
+		return pcm;
+	}
+
+	if (!(pcm = pcm_alloc(target_sample_rate)))
+		return NULL;
+	if ((res = synth_run(text, voice, pcm, NULL, 0, replay)) < 0) {
+		ao2_ref(pcm, -1);
+		return NULL;
+	}
+	*cached = res;
+	return pcm;
+}
+
+/* Playback state of a streamed synthesis on a channel */
+struct stream_state {
+	struct espeak_flight *flight;
+	struct ast_format *format;
+	size_t offset;
+	int finished;
+};
+
+static void *stream_alloc(struct ast_channel *chan, void *params)
+{
+	(void) chan;
+	return params;
+}
+
+static void stream_release(struct ast_channel *chan, void *data)
+{
+	(void) chan;
+	(void) data;
+}
+
+/* Send the next frame of audio, padding with silence if the producer
+ * is behind or at the end of the stream */
+static int stream_generate(struct ast_channel *chan, void *data, int len, int samples)
+{
+	struct stream_state *state = data;
+	struct espeak_flight *flight = state->flight;
+	short buf[AST_FRIENDLY_OFFSET / sizeof(short) + STREAM_MAX_SAMPLES];
+	short *frame_data = buf + AST_FRIENDLY_OFFSET / sizeof(short);
+	size_t count = 0;
+	struct ast_frame f = {
+		.frametype = AST_FRAME_VOICE,
+		.src = __PRETTY_FUNCTION__,
+	};
+
+	(void) len;
+	samples = MIN(samples, STREAM_MAX_SAMPLES);
+	ast_mutex_lock(&flight->lock);
+	if (flight->pcm->samples > state->offset)
+		count = MIN(flight->pcm->samples - state->offset, (size_t) samples);
+	if (!count && flight->done) {
+		state->finished = 1;
+		ast_mutex_unlock(&flight->lock);
+		return -1;
+	}
+	memcpy(frame_data, flight->pcm->data + state->offset, count * sizeof(short));
+	ast_mutex_unlock(&flight->lock);
+	memset(frame_data + count, 0, (samples - count) * sizeof(short));
+	state->offset += count;
+
+	f.subclass.format = state->format;
+	f.data.ptr = frame_data;
+	f.datalen = samples * sizeof(short);
+	f.samples = samples;
+	f.offset = AST_FRIENDLY_OFFSET;
+	return ast_write(chan, &f);
+}
+
+static struct ast_generator stream_generator = {
+	.alloc = stream_alloc,
+	.release = stream_release,
+	.generate = stream_generate,
+};
+
+/* Play a streamed synthesis from its start, while it is still being produced.
+ * Returns -1 if the synthesis failed. */
+static int stream_play(struct ast_channel *chan, struct espeak_flight *flight, const char *interrupt)
+{
+	int res = 0;
+	struct ast_frame *frame;
+	struct ast_format *old_format;
+	struct stream_state state = {
+		.flight = flight,
+		.format = flight->pcm->rate == 16000 ? ast_format_slin16 : ast_format_slin,
+	};
+
+	if (ast_channel_state(chan) != AST_STATE_UP)
+		ast_answer(chan);
+	old_format = ao2_bump(ast_channel_writeformat(chan));
+	if (ast_set_write_format(chan, state.format)) {
+		ast_log(LOG_ERROR, "eSpeak: Unable to set write format on %s\n", ast_channel_name(chan));
+		ao2_cleanup(old_format);
+		return -1;
+	}
+	if (ast_activate_generator(chan, &stream_generator, &state)) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to stream audio on %s\n", ast_channel_name(chan));
+		ast_set_write_format(chan, old_format);
+		ao2_cleanup(old_format);
+		return -1;
+	}
+	while (!state.finished) {
+		flight_hedge(flight);
+		if ((res = ast_waitfor(chan, 100)) < 0)
+			break;
+		if (res == 0)
+			continue;
+		res = 0;
+		if (!(frame = ast_read(chan))) {
+			res = -1;
+			break;
+		}
+		if (frame->frametype == AST_FRAME_DTMF && !ast_strlen_zero(interrupt)
+				&& strchr(interrupt, frame->subclass.integer)) {
+			res = frame->subclass.integer;
+			ast_frfree(frame);
+			break;
+		}
+		ast_frfree(frame);
+	}
+	ast_deactivate_generator(chan);
+	ast_set_write_format(chan, old_format);
+	ao2_cleanup(old_format);
+	ast_mutex_lock(&flight->lock);
+	if (flight->done < 0) {
+		ast_log(LOG_ERROR, "eSpeak: Streamed synthesis failed on %s\n", ast_channel_name(chan));
+		res = -1;
+	}
+	ast_mutex_unlock(&flight->lock);
+	return res;
+}
+
+struct ast_espeak_pcm *ast_espeak_synth(const char *text, const char *voice)
+{
+	struct ast_espeak_pcm *pcm;
+	int cached;
+
+	if (ast_strlen_zero(text))
+		return NULL;
+	if (ast_strlen_zero(voice))
+		voice = def_voice;
+
+	pcm = espeak_synth(text, voice, &cached, NULL);
+	request_log(text, voice, !pcm ? "error" : cached ? "cache" : "synth");
+	return pcm;
+}
+
+static int espeak_exec(struct ast_channel *chan, const char *data)
+{
+	int res = 0;
+	FILE *fl;
+	int raw_fd;
+	char *mydata;
+	char cachefile[MAXLEN];
+	char raw_name[17] = "/tmp/espk_XXXXXX";
+	char slin_name[23];
+	const char *voice;
+	struct espeak_alias *alias;
+	struct ast_espeak_pcm *pcm;
+	struct espeak_flight *flight;
+	struct timeval arrival;
+	int joined, failed;
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(text);
+		AST_APP_ARG(interrupt);
+		AST_APP_ARG(language);
+	);
+
+	if (ast_strlen_zero(data)) {
+		ast_log(LOG_ERROR, "eSpeak requires arguments (text and options)\n");
+		return -1;
+	}
+	mydata = ast_strdupa(data);
+	AST_STANDARD_APP_ARGS(args, mydata);
+
+	if (args.interrupt && !strcasecmp(args.interrupt, "any"))
+		args.interrupt = AST_DIGIT_ANY;
+
+	if (!ast_strlen_zero(args.language)) {
+		voice = args.language;
+	} else {
+		voice = def_voice;
+	}
+
+	args.text = ast_strip_quoted(args.text, "\"", "\"");
+	if (ast_strlen_zero(args.text)) {
+		ast_log(LOG_WARNING, "eSpeak: No text passed for synthesis.\n");
+		return res;
+	}
+
+	ast_debug(1,
+			  "eSpeak:\nText passed: %s\nInterrupt key(s): %s\nLanguage: %s\nRate: %lf\n",
+			  args.text, args.interrupt, voice, target_sample_rate);
+
+	/* Prerecorded alias of the text */
+	if ((alias = alias_find(args.text, voice))) {
+		ast_debug(1, "eSpeak: Playing alias %s\n", alias->sound);
+		if (ast_channel_state(chan) != AST_STATE_UP)
+			ast_answer(chan);
+		res = ast_streamfile(chan, alias->sound, ast_channel_language(chan));
+		if (res) {
+			ast_log(LOG_ERROR, "eSpeak: ast_streamfile of alias %s failed on %s\n",
+					alias->sound, ast_channel_name(chan));
+			ao2_ref(alias, -1);
+		} else {
+			ao2_ref(alias, -1);
+			ast_mutex_lock(&stats_lock);
+			alias_hits++;
+			ast_mutex_unlock(&stats_lock);
+			request_log(args.text, voice, "alias");
+			res = ast_waitstream(chan, args.interrupt);
+			ast_stopstream(chan);
+			return res;
+		}
+	}
+
+	/*Cache mechanism */
+	if (!ast_espeak_cache_lookup(args.text, voice, cachefile, sizeof(cachefile))) {
+		ast_debug(1, "eSpeak: Cache file exists.\n");
+		if (ast_channel_state(chan) != AST_STATE_UP)
+			ast_answer(chan);
+		res = ast_streamfile(chan, cachefile, ast_channel_language(chan));
+		if (res) {
+			ast_log(LOG_ERROR, "eSpeak: ast_streamfile from cache failed on %s\n",
+					ast_channel_name(chan));
+		} else {
+			ast_mutex_lock(&stats_lock);
+			cache_hits++;
+			ast_mutex_unlock(&stats_lock);
+			request_log(args.text, voice, "cache");
+			res = ast_waitstream(chan, args.interrupt);
+			ast_stopstream(chan);
+			return res;
+		}
+	}
+
+	/* Stream while synthesizing, sharing the synthesis with late callers */
+	if (streaming) {
+		arrival = ast_tvnow();
+		if (!(flight = flight_get(args.text, voice, &joined, NULL))) {
+			request_log(args.text, voice, "error");
+			return -1;
+		}
+		res = stream_play(chan, flight, args.interrupt);
+		ast_mutex_lock(&flight->lock);
+		failed = flight->done < 0;
+		ast_mutex_unlock(&flight->lock);
+		ao2_ref(flight, -1);
+		request_log_at(arrival, args.text, voice, failed ? "error" : joined ? "join" : "stream");
+		return res;
+	}
+
+	/* Invoke eSpeak */
+	if (!(pcm = ast_espeak_synth(args.text, voice)))
+		return -1;
+
+	/* Play from the cache if the audio was saved there, else from a temp file */
+	if (!ast_espeak_cache_lookup(args.text, voice, cachefile, sizeof(cachefile))) {
+		ao2_ref(pcm, -1);
+		if (ast_channel_state(chan) != AST_STATE_UP)
+			ast_answer(chan);
+		res = ast_streamfile(chan, cachefile, ast_channel_language(chan));
+		if (res) {
+			ast_log(LOG_ERROR, "eSpeak: ast_streamfile from cache failed on %s\n",
+					ast_channel_name(chan));
+		} else {
+			res = ast_waitstream(chan, args.interrupt);
+			ast_stopstream(chan);
+		}
+		return res;
+	}
+
+	if ((raw_fd = mkstemp(raw_name)) == -1) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to create audio file.\n");
+		ao2_ref(pcm, -1);
+		return -1;
+	}
+	if ((fl = fdopen(raw_fd, "w+")) == NULL) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to open audio file '%s'\n", raw_name);
+		close(raw_fd);
+		unlink(raw_name);
+		ao2_ref(pcm, -1);
+		return -1;
+	}
+	res = pcm_fwrite(pcm, fl);
+	fclose(fl);
+	snprintf(slin_name, sizeof(slin_name), "%s.%s", raw_name, pcm_format(pcm));
+	ao2_ref(pcm, -1);
+	if (res) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to write audio file '%s'\n", raw_name);
+		unlink(raw_name);
+		return -1;
+	}
+	rename(raw_name, slin_name);
+
+	if (ast_channel_state(chan) != AST_STATE_UP)
+		ast_answer(chan);
+	res = ast_streamfile(chan, raw_name, ast_channel_language(chan));
+	if (res) {
+		ast_log(LOG_ERROR, "eSpeak: ast_streamfile failed on %s\n", ast_channel_name(chan));
+	} else {
+		res = ast_waitstream(chan, args.interrupt);
+		ast_stopstream(chan);
+	}
+	unlink(slin_name);
+	return res;
+}
+
+/* Background synthesis of texts probed with ESPEAK_CACHED() */
+struct fill_request {
+	AST_LIST_ENTRY(fill_request) list;
+	const char *voice;
+	char text[0];
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(fill_queue, fill_request);
+static ast_cond_t fill_cond;
+static pthread_t fill_thread = AST_PTHREADT_NULL;
+static int fill_queued;
+
+/* Queue a text for background synthesis, unless already queued */
+static void fill_queue_add(const char *text, const char *voice)
+{
+	struct fill_request *req;
+
+	ast_mutex_lock(&fill_lock);
+	if (fill_queued >= FILL_QUEUE_MAX) {
+		ast_mutex_unlock(&fill_lock);
+		return;
+	}
+	AST_LIST_TRAVERSE(&fill_queue, req, list) {
+		if (!strcmp(req->text, text) && !strcmp(req->voice, voice)) {
+			ast_mutex_unlock(&fill_lock);
+			return;
+		}
+	}
+	if ((req = ast_calloc(1, sizeof(*req) + strlen(text) + strlen(voice) + 2))) {
+		strcpy(req->text, text);
+		req->voice = strcpy(req->text + strlen(text) + 1, voice);
+		AST_LIST_INSERT_TAIL(&fill_queue, req, list);
+		fill_queued++;
+		ast_cond_signal(&fill_cond);
+	}
+	ast_mutex_unlock(&fill_lock);
+}
+
+/* Synthesize a text into the cache at low priority. Returns -2 if it
+ * gave way to a caller, the partial audio is dropped. */
+static int fill_run(const char *text, const char *voice)
+{
+	struct ast_espeak_pcm *pcm;
+	char cachefile[MAXLEN];
+	int res;
+
+	if (!ast_espeak_cache_lookup(text, voice, cachefile, sizeof(cachefile)))
+		return 0;
+	if (!(pcm = pcm_alloc(target_sample_rate)))
+		return -1;
+	if (!(res = synth_run(text, voice, pcm, NULL, 1, NULL))) {
+		ast_mutex_lock(&stats_lock);
+		cache_fills++;
+		ast_mutex_unlock(&stats_lock);
+	}
+	ao2_ref(pcm, -1);
+	return res;
+}
+
+/* Synthesize queued texts into the cache while no caller is waiting
+ * for the engine. A fill stops when a caller arrives and is retried. */
+static void *fill_thread_run(void *data)
+{
+	struct fill_request *req;
+	int busy;
+
+	(void) data;
+	ast_mutex_lock(&fill_lock);
+	while (!fill_stop) {
+		if (!(req = AST_LIST_REMOVE_HEAD(&fill_queue, list))) {
+			ast_cond_wait(&fill_cond, &fill_lock);
+			continue;
+		}
+		fill_queued--;
+		ast_mutex_unlock(&fill_lock);
+
+		do {
+			ast_mutex_lock(&stats_lock);
+			busy = active_synth;
+			ast_mutex_unlock(&stats_lock);
+			if (busy)
+				usleep(FILL_BACKOFF);
+		} while (busy && !fill_stopping());
+		if (!fill_stopping() && fill_run(req->text, req->voice) == -2) {
+			ast_mutex_lock(&fill_lock);
+			AST_LIST_INSERT_HEAD(&fill_queue, req, list);
+			fill_queued++;
+			continue;
+		}
+		ast_free(req);
+		ast_mutex_lock(&fill_lock);
+	}
+	while ((req = AST_LIST_REMOVE_HEAD(&fill_queue, list)))
+		ast_free(req);
+	fill_queued = 0;
+	ast_mutex_unlock(&fill_lock);
+	return NULL;
+}
+
+/* ESPEAK_CACHED(text[,voice[,options]]): 1 if eSpeak() would play the text
+ * without synthesis, 0 otherwise. With the f option, a miss is
+ * synthesized into the cache in the background. */
+static int espeak_cached_read(struct ast_channel *chan, const char *cmd, char *data,
+		char *buf, size_t len)
+{
+	struct espeak_alias *alias;
+	char cachefile[MAXLEN];
+	const char *voice;
+	int cached;
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(text);
+		AST_APP_ARG(voice);
+		AST_APP_ARG(options);
+	);
+
+	(void) chan;
+	if (ast_strlen_zero(data)) {
+		ast_log(LOG_ERROR, "%s requires arguments (text[,voice[,options]])\n", cmd);
+		return -1;
+	}
+	AST_STANDARD_APP_ARGS(args, data);
+	args.text = ast_strip_quoted(args.text, "\"", "\"");
+	if (ast_strlen_zero(args.text)) {
+		ast_log(LOG_WARNING, "eSpeak: No text passed to %s.\n", cmd);
+		return -1;
+	}
+	voice = ast_strlen_zero(args.voice) ? def_voice : args.voice;
+
+	if ((alias = alias_find(args.text, voice))) {
+		ao2_ref(alias, -1);
+		cached = 1;
+	} else {
+		cached = !ast_espeak_cache_lookup(args.text, voice, cachefile, sizeof(cachefile));
+	}
+	if (!cached && usecache && args.options && strchr(args.options, 'f'))
+		fill_queue_add(args.text, voice);
+
+	ast_copy_string(buf, cached ? "1" : "0", len);
+	return 0;
+}
+
+static struct ast_custom_function espeak_cached_function = {
+	.name = "ESPEAK_CACHED",
+	.read = espeak_cached_read,
+};
+
+struct replay_request {
+	struct replay *replay;
+	/* Logged as streamed, replayed up to the first audio */
+	int stream;
+	const char *voice;
+	char text[0];
+};
+
+/* Replay keys are plain strings, so objects and search keys look alike */
+static int replay_key_hash_fn(const void *obj, const int flags)
+{
+	(void) flags;
+	return ast_str_hash(obj);
+}
+
+static int replay_key_cmp_fn(void *obj, void *arg, int flags)
+{
+	(void) flags;
+	return strcmp(obj, arg) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+/* Fetch a text from the cache or stream it like eSpeak() in streaming
+ * mode, returning as soon as the first audio is available */
+static struct ast_espeak_pcm *replay_stream(struct replay *replay, const char *text,
+		const char *voice, int *cached)
+{
+	struct ast_espeak_pcm *pcm;
+	struct espeak_flight *flight;
+	char cachefile[MAXLEN];
+	int joined;
+
+	*cached = 1;
+	if (!cache_lookup(text, voice, cachefile, sizeof(cachefile), replay)
+			&& (pcm = pcm_read(cachefile)))
+		return pcm;
+	*cached = 0;
+	if (!(flight = flight_get(text, voice, &joined, replay)))
+		return NULL;
+	ast_mutex_lock(&flight->lock);
+	while (!flight->done && !flight->pcm->samples) {
+		struct timeval wait = ast_tvadd(ast_tvnow(), ast_tv(0, 100000));
+		struct timespec ts = {
+			.tv_sec = wait.tv_sec,
+			.tv_nsec = wait.tv_usec * 1000,
+		};
+
+		ast_cond_timedwait(&flight->cond, &flight->lock, &ts);
+		ast_mutex_unlock(&flight->lock);
+		flight_hedge(flight);
+		ast_mutex_lock(&flight->lock);
+	}
+	pcm = flight->done < 0 ? NULL : ao2_bump(flight->pcm);
+	ast_mutex_unlock(&flight->lock);
+	ao2_ref(flight, -1);
+	return pcm;
+}
+
+static void *replay_request_thread(void *data)
+{
+	struct replay_request *req = data;
+	struct replay *replay = req->replay;
+	struct ast_espeak_pcm *pcm;
+	struct timeval start = ast_tvnow();
+	int64_t *latency;
+	int64_t elapsed;
+	int cached;
+
+	if (req->stream)
+		pcm = replay_stream(replay, req->text, req->voice, &cached);
+	else
+		pcm = espeak_synth(req->text, req->voice, &cached, replay);
+	elapsed = ast_tvdiff_ms(ast_tvnow(), start);
+	ast_mutex_lock(&replay->lock);
+	if (!pcm) {
+		replay->failed++;
+	} else {
+		replay->hits += cached;
+		if (replay->latency_count == replay->latency_alloc) {
+			replay->latency_alloc = MAX(replay->latency_alloc * 2, 256);
+			if ((latency = ast_realloc(replay->latency, replay->latency_alloc * sizeof(*latency)))) {
+				replay->latency = latency;
+			} else {
+				replay->latency_alloc = replay->latency_count;
+			}
+		}
+		if (replay->latency_count < replay->latency_alloc)
+			replay->latency[replay->latency_count++] = elapsed;
+	}
+	replay->pending--;
+	ast_cond_signal(&replay->cond);
+	ast_mutex_unlock(&replay->lock);
+	ao2_cleanup(pcm);
+	ast_free(req);
+	return NULL;
+}
+
+/* Start one logged request, if its text was captured */
+static void replay_entry(struct replay *replay, char *line)
+{
+	char *fields[6];
+	char *text, *key;
+	struct replay_request *req;
+	pthread_t thread;
+	int i;
+
+	for (i = 0; i < 6; i++) {
+		if (!(fields[i] = strsep(&line, "\t")))
+			return;
+	}
+	text = line;
+	replay->requests++;
+	if (!strcmp(fields[5], "alias")) {
+		replay->aliases++;
+		return;
+	}
+
+	/* Cache simulation on the logged hashes, assuming an unbounded cache */
+	if ((key = ao2_alloc(strlen(fields[1]) + strlen(fields[3]) + 2, NULL))) {
+		sprintf(key, "%s|%s", fields[3], fields[1]);
+		if (ao2_find(replay->seen, key, OBJ_SEARCH_KEY | OBJ_NODATA)) {
+			replay->predicted_hits++;
+		} else {
+			ao2_link(replay->seen, key);
+		}
+		ao2_ref(key, -1);
+	}
+
+	if (ast_strlen_zero(text))
+		return;
+	text[strcspn(text, "\r\n")] = '\0';
+	if (!(req = ast_malloc(sizeof(*req) + strlen(text) + strlen(fields[3]) + 2)))
+		return;
+	req->replay = replay;
+	req->stream = !strcmp(fields[5], "stream") || !strcmp(fields[5], "join");
+	strcpy(req->text, text);
+	req->voice = strcpy(req->text + strlen(text) + 1, fields[3]);
+	ast_mutex_lock(&replay->lock);
+	/* Bound the threads, further requests start as earlier ones finish */
+	if (replay->pending >= REPLAY_MAX_PENDING)
+		replay->throttled++;
+	while (replay->pending >= REPLAY_MAX_PENDING)
+		ast_cond_wait(&replay->cond, &replay->lock);
+	replay->pending++;
+	replay->replayed++;
+	ast_mutex_unlock(&replay->lock);
+	if (ast_pthread_create_detached(&thread, NULL, replay_request_thread, req)) {
+		ast_mutex_lock(&replay->lock);
+		replay->pending--;
+		replay->replayed--;
+		ast_mutex_unlock(&replay->lock);
+		ast_free(req);
+	}
+}
+
+static void replay_destructor(void *obj)
+{
+	struct replay *replay = obj;
+	struct dirent *entry;
+	char path[MAXLEN];
+	DIR *dir;
+
+	/* Remove the scratch cache */
+	if (replay->cachedir && (dir = opendir(replay->cachedir))) {
+		while ((entry = readdir(dir))) {
+			if (entry->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", replay->cachedir, entry->d_name);
+			unlink(path);
+		}
+		closedir(dir);
+		rmdir(replay->cachedir);
+	}
+	ao2_cleanup(replay->seen);
+	ao2_cleanup(replay->flights);
+	ast_cond_destroy(&replay->cond);
+	ast_mutex_destroy(&replay->lock);
+	ast_free(replay->latency);
+	ast_free(replay->cachedir);
+	ast_free(replay->fname);
+	ast_mutex_lock(&stats_lock);
+	replay_running = 0;
+	ast_mutex_unlock(&stats_lock);
+}
+
+/* Replay a request log, reproducing the logged arrival times */
+static void *replay_thread(void *data)
+{
+	struct replay *replay = data;
+	FILE *fl;
+	char line[MAXLEN * 2];
+	double first = -1, stamp;
+	struct timeval start = ast_tvnow(), due;
+	int64_t wait, p50 = 0, p95 = 0, max = 0;
+
+	if ((fl = fopen(replay->fname, "r")) == NULL) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to open request log %s for replay\n", replay->fname);
+		goto CLEAN;
+	}
+	while (fgets(line, sizeof(line), fl)) {
+		if ((stamp = strtod(line, NULL)) <= 0)
+			continue;
+		if (first < 0)
+			first = stamp;
+		due = ast_tvadd(start, ast_samp2tv(MAX(stamp - first, 0) / replay->speedup * 1000, 1000));
+		if ((wait = ast_tvdiff_ms(due, ast_tvnow())) > 0)
+			usleep(wait * 1000);
+		replay_entry(replay, line);
+	}
+	fclose(fl);
+
+	ast_mutex_lock(&replay->lock);
+	while (replay->pending)
+		ast_cond_wait(&replay->cond, &replay->lock);
+	ast_mutex_unlock(&replay->lock);
+
+	if (replay->latency_count) {
+		qsort(replay->latency, replay->latency_count, sizeof(*replay->latency), latency_cmp);
+		p50 = replay->latency[replay->latency_count / 2];
+		p95 = replay->latency[replay->latency_count * 95 / 100];
+		max = replay->latency[replay->latency_count - 1];
+	}
+	ast_log(LOG_NOTICE, "eSpeak: Replay of %s finished: %u requests, %u aliases, "
+			"predicted cache hit rate %.1f%%\n", replay->fname, replay->requests, replay->aliases,
+			replay->requests > replay->aliases ?
+			100.0 * replay->predicted_hits / (replay->requests - replay->aliases) : 0);
+	ast_log(LOG_NOTICE, "eSpeak: Replayed %u texts: %u cache hits, %u failures, %u hedges, "
+			"%u started late, latency p50 %" PRId64 " ms, p95 %" PRId64 " ms, max %" PRId64 " ms\n",
+			replay->replayed, replay->hits, replay->failed, replay->hedges, replay->throttled,
+			p50, p95, max);
+
+CLEAN:
+	/* Flights still running after their first audio keep the replay */
+	ao2_ref(replay, -1);
+	return NULL;
+}
+
+static char *handle_cli_espeak_replay(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct replay *replay;
+	pthread_t thread;
+	double speedup = 1;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "espeak replay";
+		e->usage =
+			"Usage: espeak replay <logfile> [speedup]\n"
+			"       Replay a request log against the running module, reproducing\n"
+			"       the logged arrival times, divided by speedup if given. Texts\n"
+			"       captured in the log are synthesized, the cache hit rate is\n"
+			"       predicted for all entries. Results are logged when done.\n"
+			"       Requests logged as streamed are streamed again and their\n"
+			"       latency is the time to first audio.\n"
+			"       Replays start from an empty scratch cache, removed when done,\n"
+			"       and leave the statistics and quality tier alone. Requests run\n"
+			"       at once are bounded, the excess start late.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+	if (a->argc != 3 && a->argc != 4)
+		return CLI_SHOWUSAGE;
+	if (a->argc == 4 && (speedup = strtod(a->argv[3], NULL)) <= 0)
+		return CLI_SHOWUSAGE;
+
+	ast_mutex_lock(&stats_lock);
+	if (replay_running) {
+		ast_mutex_unlock(&stats_lock);
+		ast_cli(a->fd, "A replay is already running.\n");
+		return CLI_FAILURE;
+	}
+	replay_running = 1;
+	ast_mutex_unlock(&stats_lock);
+
+	if (!(replay = ao2_alloc(sizeof(*replay), replay_destructor))) {
+		ast_mutex_lock(&stats_lock);
+		replay_running = 0;
+		ast_mutex_unlock(&stats_lock);
+		return CLI_FAILURE;
+	}
+	/* From here on the destructor cleans up */
+	ast_mutex_init(&replay->lock);
+	ast_cond_init(&replay->cond, NULL);
+	replay->speedup = speedup;
+	if (!(replay->fname = ast_strdup(a->argv[2]))
+			|| !(replay->seen = ao2_container_alloc(ALIAS_BUCKETS, replay_key_hash_fn, replay_key_cmp_fn))
+			|| !(replay->flights = ao2_container_alloc(FLIGHT_BUCKETS, flight_hash_fn, flight_cmp_fn))
+			|| !(replay->cachedir = ast_strdup(REPLAY_CACHE))) {
+		ao2_ref(replay, -1);
+		return CLI_FAILURE;
+	}
+	if (!mkdtemp(replay->cachedir)) {
+		ast_cli(a->fd, "Failed to create a scratch cache: %s\n", strerror(errno));
+		ast_free(replay->cachedir);
+		replay->cachedir = NULL;
+		ao2_ref(replay, -1);
+		return CLI_FAILURE;
+	}
+	/* Keep the replay while reporting, the thread drops its own reference */
+	ao2_ref(replay, +1);
+	if (ast_pthread_create_detached(&thread, NULL, replay_thread, replay)) {
+		ao2_ref(replay, -2);
+		return CLI_FAILURE;
+	}
+	ast_cli(a->fd, "Replaying %s against the scratch cache %s, results will be logged when done.\n",
+			a->argv[2], replay->cachedir);
+	ao2_ref(replay, -1);
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_espeak_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "espeak show stats";
+		e->usage =
+			"Usage: espeak show stats\n"
+			"       Show eSpeak synthesis statistics and quality tier.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	ast_mutex_lock(&stats_lock);
+	ast_cli(a->fd, "Alias hits:         %u\n", alias_hits);
+	ast_cli(a->fd, "Cache hits:         %u\n", cache_hits);
+	ast_cli(a->fd, "Stream joins:       %u\n", stream_joins);
+	ast_cli(a->fd, "Hedges:             %u (%u answered first)\n", hedges, hedge_wins);
+	ast_cli(a->fd, "Background fills:   %u\n", cache_fills);
+	ast_cli(a->fd, "Silence compacted:  %" PRIu64 " samples\n", compact_samples);
+	ast_cli(a->fd, "Syntheses:          %u\n", synth_count);
+	ast_cli(a->fd, "Active syntheses:   %d\n", active_synth);
+	ast_cli(a->fd, "Real-time factor:   %.3f\n", rtf_avg);
+	ast_cli(a->fd, "Engine wait:        %.0f ms\n", wait_avg);
+	ast_cli(a->fd, "Quality tier:       %s%s\n", degrade_tiers[degrade_tier].name,
+			degrade ? "" : " (degradation disabled)");
+	ast_cli(a->fd, "Tier changes:       %u\n", tier_changes);
+	ast_cli(a->fd, "DSP kernels:        s16->float %s, float->s16 %s\n",
+			dsp_s16_to_float->name, dsp_float_to_s16->name);
+	ast_mutex_unlock(&stats_lock);
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_espeak[] = {
+	AST_CLI_DEFINE(handle_cli_espeak_show_stats, "Show eSpeak statistics"),
+	AST_CLI_DEFINE(handle_cli_espeak_replay, "Replay an eSpeak request log"),
+};
+
+static int reload_module(void)
+{
+	ast_config_destroy(cfg);
+	read_config(ESPEAK_CONFIG);
+	return 0;
+}
+
+/* Stop the fill thread and release what load_module() set up */
+static void module_cleanup(void)
+{
+	ast_mutex_lock(&fill_lock);
+	fill_stop = 1;
+	ast_cond_signal(&fill_cond);
+	ast_mutex_unlock(&fill_lock);
+	if (fill_thread != AST_PTHREADT_NULL) {
+		pthread_join(fill_thread, NULL);
+		fill_thread = AST_PTHREADT_NULL;
+	}
+	ast_cond_destroy(&fill_cond);
+	ast_mutex_lock(&engine_lock);
+	espeak_Terminate();
+	ast_mutex_unlock(&engine_lock);
+	ast_config_destroy(cfg);
+	ao2_global_obj_release(alias_map);
+	request_log_open(NULL);
+	ao2_ref(flights, -1);
+}
+
+static int unload_module(void)
+{
+	int res, hedging;
+
+	/* Stop taking new requests before tearing down */
+	res = ast_unregister_application(app);
+	ast_custom_function_unregister(&espeak_cached_function);
+	ast_cli_unregister_multiple(cli_espeak, ARRAY_LEN(cli_espeak));
+	ast_format_def_unregister(esr_f.name);
+	ast_format_def_unregister(esr16_f.name);
+	ast_mutex_lock(&stats_lock);
+	if (replay_running) {
+		ast_mutex_unlock(&stats_lock);
+		ast_log(LOG_WARNING, "eSpeak: Cannot unload while a request log replay is running\n");
+		goto BUSY;
+	}
+	hedging = hedges_running;
+	ast_mutex_unlock(&stats_lock);
+	if (ao2_container_count(flights) || hedging) {
+		ast_log(LOG_WARNING, "eSpeak: Cannot unload while syntheses are streaming\n");
+		goto BUSY;
+	}
+	module_cleanup();
+	return res;
+
+BUSY:
+	ast_format_def_register(&esr_f);
+	ast_format_def_register(&esr16_f);
+	ast_cli_register_multiple(cli_espeak, ARRAY_LEN(cli_espeak));
+	ast_custom_function_register(&espeak_cached_function);
+	ast_register_application(app, espeak_exec, synopsis, descrip);
+	return -1;
+}
+
+static int load_module(void)
+{
+	read_config(ESPEAK_CONFIG);
+	if (!(flights = ao2_container_alloc(FLIGHT_BUCKETS, flight_hash_fn, flight_cmp_fn))
+			|| (engine_rate = espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS, ESPK_BUFFER, NULL, 0)) == -1) {
+		ast_log(LOG_ERROR, "eSpeak: Internal espeak error, aborting.\n");
+		ao2_cleanup(flights);
+		ast_config_destroy(cfg);
+		ao2_global_obj_release(alias_map);
+		request_log_open(NULL);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	espeak_SetSynthCallback(synth_callback);
+	dsp_select();
+	engine_voice[0] = '\0';
+	ast_mutex_lock(&fill_lock);
+	fill_stop = 0;
+	ast_mutex_unlock(&fill_lock);
+	ast_cond_init(&fill_cond, NULL);
+	if (ast_pthread_create(&fill_thread, NULL, fill_thread_run, NULL)) {
+		ast_log(LOG_WARNING, "eSpeak: Failed to start cache fill thread\n");
+		fill_thread = AST_PTHREADT_NULL;
+	}
+	/* Compacted cache files play like any other sound file */
+	esr_f.format = ast_format_slin;
+	esr16_f.format = ast_format_slin16;
+	if (ast_format_def_register(&esr_f) || ast_format_def_register(&esr16_f)) {
+		ast_log(LOG_ERROR, "eSpeak: Failed to register compacted audio formats\n");
+		ast_format_def_unregister(esr_f.name);
+		module_cleanup();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	ast_custom_function_register(&espeak_cached_function);
+	ast_cli_register_multiple(cli_espeak, ARRAY_LEN(cli_espeak));
+	if (ast_register_application(app, espeak_exec, synopsis, descrip)) {
+		ast_cli_unregister_multiple(cli_espeak, ARRAY_LEN(cli_espeak));
+		ast_custom_function_unregister(&espeak_cached_function);
+		ast_format_def_unregister(esr_f.name);
+		ast_format_def_unregister(esr16_f.name);
+		module_cleanup();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	return AST_MODULE_LOAD_SUCCESS;
 }
 
-AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "eSpeak TTS Interface",
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_GLOBAL_SYMBOLS | AST_MODFLAG_LOAD_ORDER, "eSpeak TTS Interface",
 	.load = load_module,
 	.unload = unload_module,
 	.reload = reload_module,
+	.load_pri = AST_MODPRI_APP_DEPEND,
 );
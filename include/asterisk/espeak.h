@@ -0,0 +1,83 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2009 - 2016, Lefteris Zafiris
+ *
+ * Lefteris Zafiris <zaf@fastmail.com>
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief eSpeak TTS synthesis API, provided by app_espeak.
+ *
+ * Modules using this API should list app_espeak in their
+ * MODULEINFO dependencies, so that it is loaded first.
+ */
+
+#ifndef _ASTERISK_ESPEAK_H
+#define _ASTERISK_ESPEAK_H
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+/*!
+ * \brief Synthesized audio, mono 16 bit signed linear.
+ *
+ * This is an ao2 object, release it with ao2_ref(pcm, -1).
+ */
+struct ast_espeak_pcm {
+	/*! Sample rate in Hz, the configured samplerate */
+	unsigned int rate;
+	/*! Number of samples in data */
+	size_t samples;
+	/*! Allocated size of data, in samples */
+	size_t allocated;
+	/*! Audio samples */
+	short *data;
+};
+
+/*!
+ * \brief Synthesize text with the shared eSpeak engine.
+ *
+ * \param text Text to synthesize
+ * \param voice eSpeak voice name, NULL for the configured default
+ *
+ * Audio is returned from the cache when available. Otherwise the text
+ * is synthesized with the configured voice parameters and, if caching
+ * is enabled, stored in the cache.
+ *
+ * \return Reference to the audio
+ * \retval NULL on failure
+ */
+struct ast_espeak_pcm *ast_espeak_synth(const char *text, const char *voice);
+
+/*!
+ * \brief Look up text in the eSpeak cache.
+ *
+ * \param text Text to look up
+ * \param voice eSpeak voice name, NULL for the configured default
+ * \param path Filled with the cache file name without extension,
+ *             suitable for ast_streamfile()
+ * \param len Size of path
+ *
+ * \retval 0 if the text is cached
+ * \retval -1 if it is not cached or caching is disabled
+ */
+int ast_espeak_cache_lookup(const char *text, const char *voice, char *path, size_t len);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}
+#endif
+
+#endif /* _ASTERISK_ESPEAK_H */